@@ -71,8 +71,17 @@ struct ploop_functions {
 	int (*get_devs)(struct ploop_disk_images_data *di, char **out[]);
 	void (*free_array)(char *array[]);
 	/* 1.10: no new functions */
+	/* 1.11 */
+	int (*scrub_image)(struct ploop_disk_images_data *di, struct ploop_scrub_param *param);
+	int (*discard_schedule)(struct ploop_discard_sched_param *param);
+	int (*discard_get_stat_ex)(struct ploop_disk_images_data *di, struct ploop_discard_stat_ex *pd_stat);
+	int (*mount_images)(struct ploop_batch_image *images, int n, struct ploop_batch_param *param);
+	int (*umount_images)(struct ploop_batch_image *images, int n, struct ploop_batch_param *param);
+	int (*refill_delta_pool)(struct ploop_disk_images_data *di, int count);
+	int (*snapshot_diff)(struct ploop_disk_images_data *di, const char *guid_from, const char *guid_to, struct ploop_snapshot_diff **out);
+	void (*free_snapshot_diff)(struct ploop_snapshot_diff *diff);
 	/* padding for up to 64 pointers */
-	void *padding[22];
+	void *padding[14];
 }; /* struct ploop_functions */
 
 __attribute__ ((visibility("default")))
@@ -46,7 +46,12 @@ struct ploop_mount_param {
 	char *mount_data;
 	unsigned int blocksize; /* blocksize for raw image */
 	int fsck;
-	char dummy[32];
+	int alloc_journal; /* keep allocation journal for the top delta */
+	int unused2;
+	__u64 prefetch;	/* index/data warm-up budget, bytes, 0 - off */
+	char *prefetch_list; /* file with hot cluster numbers to warm up */
+	/* the struct keeps its size with 32-bit pointers too */
+	char dummy[16 - sizeof(char *)];
 };
 
 struct ploop_create_param {
@@ -92,12 +97,16 @@ struct ploop_disk_images_data {
 struct ploop_resize_param {
 	unsigned long long size;
 	int offline_resize;
-	char dummy[32];
+	__u64 balloon_step;	/* inflate the balloon by that much at a time */
+	__u64 balloon_rate;	/* balloon inflation limit, bytes/sec */
+	char dummy[16];
 };
 
 struct ploop_snapshot_param {
 	char *guid;	/* guid for new snapshot, autogenerated if NULL */
-	char dummy[32];
+	int pool;	/* keep that many empty deltas ready for the next
+			   snapshots, see ploop_refill_delta_pool() */
+	char dummy[28];
 };
 
 struct ploop_snapshot_switch_param {
@@ -111,6 +120,18 @@ struct ploop_merge_param {
 	int unused1;
 	int merge_all;
 	const char *guid;
+	int choose_direction;	/* merge parent into child if it is cheaper */
+	int unused2;
+	__u64 moved_bytes;	/* out: estimated data moved by all steps */
+	char dummy[16];
+};
+
+struct ploop_scrub_param {
+	int threads;		/* reader threads, 0 - default */
+	int unused1;
+	__u64 rate;		/* read rate limit, bytes/sec, 0 - unlimited */
+	__u64 max_bytes;	/* verify at most that much per run, 0 - all */
+	__u64 mismatches;	/* out: number of corrupted clusters */
 	char dummy[32];
 };
 
@@ -122,6 +143,29 @@ struct ploop_discard_param {
 	char dummy[32];
 };
 
+struct ploop_discard_sched_param {
+	int max_jobs;		/* simultaneous discards, 0 - one */
+	int interval;		/* seconds between scans, 0 - scan once */
+	__u64 bw_limit;		/* space handed to discards, bytes/sec, 0 - unlimited */
+	__u64 step;		/* max space to free per run, 0 - default */
+	__u64 min_gain;		/* skip images with less reclaimable space */
+	__u64 minlen_b;
+	const int *stop;
+	char dummy[32];
+};
+
+struct ploop_batch_image {
+	struct ploop_disk_images_data *di;
+	struct ploop_mount_param *param;	/* mount only */
+	int result;		/* out: SYSEXIT_* code of this image */
+	char dummy[28];
+};
+
+struct ploop_batch_param {
+	int threads;		/* simultaneous mounts, 0 - default */
+	char dummy[60];
+};
+
 struct ploop_info {
 	unsigned long long fs_bsize;
 	unsigned long long fs_blocks;
@@ -144,6 +188,28 @@ struct ploop_discard_stat {
 	off_t balloon_size;
 };
 
+#define PLOOP_FREE_HIST_SIZE	32
+
+struct ploop_discard_stat_ex {
+	struct ploop_discard_stat stat;
+	__u32 cluster;		/* ploop cluster size, bytes */
+	int hist_valid;		/* 0 if the fs can't report its free space */
+	/* free extents of [2^i, 2^(i+1)) whole clusters */
+	__u64 free_extents[PLOOP_FREE_HIST_SIZE];
+	__u64 free_bytes[PLOOP_FREE_HIST_SIZE];
+	/* space a discard with minlen of 2^i clusters can give back */
+	__u64 reclaimable[PLOOP_FREE_HIST_SIZE];
+	char dummy[64];
+};
+
+/* Clusters that differ between two snapshots, see ploop_snapshot_diff() */
+struct ploop_snapshot_diff {
+	__u32 blocksize;	/* cluster size, sectors */
+	__u64 nclusters;	/* clusters covered by the bitmap */
+	__u64 changed;		/* bits set in the bitmap */
+	__u64 *bitmap;		/* bit N of word N / 64: cluster N changed */
+};
+
 /* Constants for ploop_set_verbose_level(): */
 #define PLOOP_LOG_NOCONSOLE	-2	/* disable all console logging */
 #define PLOOP_LOG_NOSTDOUT	-1	/* disable all but errors to stderr */
@@ -171,11 +237,21 @@ int ploop_mount_image(struct ploop_disk_images_data *di, struct ploop_mount_para
 int ploop_mount_snapshot(struct ploop_disk_images_data *di, struct ploop_mount_param *param);
 int ploop_umount(const char *device, struct ploop_disk_images_data *di);
 int ploop_umount_image(struct ploop_disk_images_data *di);
+int ploop_mount_images(struct ploop_batch_image *images, int n,
+		struct ploop_batch_param *param);
+int ploop_umount_images(struct ploop_batch_image *images, int n,
+		struct ploop_batch_param *param);
 int ploop_resize_image(struct ploop_disk_images_data *di, struct ploop_resize_param *param);
 int ploop_convert_image(struct ploop_disk_images_data *di, int mode, int flags);
 int ploop_get_info_by_descr(const char *descr, struct ploop_info *info);
 int ploop_create_snapshot(struct ploop_disk_images_data *di, struct ploop_snapshot_param *param);
+int ploop_refill_delta_pool(struct ploop_disk_images_data *di, int count);
+int ploop_snapshot_diff(struct ploop_disk_images_data *di,
+		const char *guid_from, const char *guid_to,
+		struct ploop_snapshot_diff **out);
+void ploop_free_snapshot_diff(struct ploop_snapshot_diff *diff);
 int ploop_merge_snapshot(struct ploop_disk_images_data *di, struct ploop_merge_param *param);
+int ploop_scrub_image(struct ploop_disk_images_data *di, struct ploop_scrub_param *param);
 int ploop_switch_snapshot_ex(struct ploop_disk_images_data *di, struct ploop_snapshot_switch_param *param);
 int ploop_switch_snapshot(struct ploop_disk_images_data *di, const char *uuid, int flags);
 int ploop_delete_snapshot(struct ploop_disk_images_data *di, const char *guid);
@@ -209,8 +285,11 @@ int ploop_receive(const char *dst);
 
 int ploop_discard_get_stat(struct ploop_disk_images_data *di,
 		struct ploop_discard_stat *pd_stat);
+int ploop_discard_get_stat_ex(struct ploop_disk_images_data *di,
+		struct ploop_discard_stat_ex *pd_stat);
 int ploop_discard(struct ploop_disk_images_data *di,
 			struct ploop_discard_param *param);
+int ploop_discard_schedule(struct ploop_discard_sched_param *param);
 
 #ifdef __cplusplus
 }
@@ -260,6 +339,7 @@ enum
 	SYSEXIT_DISKDESCR,
 	SYSEXIT_DEV_NOT_MOUNTED,
 	SYSEXIT_FSCK,
+	SYSEXIT_CSUM,
 };
 
 #pragma GCC visibility pop
@@ -27,13 +27,16 @@
 #include <sys/stat.h>
 #include <sys/vfs.h>
 #include <sys/file.h>
-#include <sys/wait.h>
 #include <sys/user.h>
 #include <sys/param.h>
 #include <sys/ioctl.h>
+#include <sys/eventfd.h>
+#include <poll.h>
+#include <pthread.h>
 #include <linux/types.h>
 #include <linux/fs.h>
 #include <string.h>
+#include <time.h>
 
 #include "ploop.h"
 #include "ploop_if.h"
@@ -162,18 +165,6 @@ static int open_top_delta(const char *device, struct delta *delta, int *lvl)
 	return 0;
 }
 
-static __u32 *alloc_reverse_map(__u32 len)
-{
-	__u32 *reverse_map;
-
-	reverse_map = malloc(len * sizeof(__u32));
-	if (reverse_map == NULL) {
-		ploop_err(errno, "Can't allocate reverse map");
-		return NULL;
-	}
-	return reverse_map;
-}
-
 static int do_truncate(int fd, int mntn_type, off_t old_size, off_t new_size)
 {
 	int ret;
@@ -215,9 +206,62 @@ static int do_truncate(int fd, int mntn_type, off_t old_size, off_t new_size)
 	return 0;
 }
 
-static int do_inflate(int fd, int mntn_type, off_t old_size, off_t *new_size, int *drop_state)
+/* Grow the balloon from @cur to @new_size by @step bytes at a time,
+ * at most @rate bytes per second, giving up between the steps if the
+ * operation is cancelled. On return @cur is the size reached.
+ */
+static int inflate_steps(int fd, off_t *cur, off_t new_size,
+		__u64 step, __u64 rate, int *cancelled)
+{
+	struct timespec start, now;
+	off_t old_size = *cur, next;
+	double elapsed, expected;
+	int err;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	while (*cur < new_size) {
+		if (*cur != old_size && is_operation_cancelled()) {
+			ploop_log(0, "Balloon inflation cancelled at %llu bytes",
+					(unsigned long long)*cur);
+			*cancelled = 1;
+			break;
+		}
+
+		next = step && new_size - *cur > step ? *cur + step : new_size;
+		err = sys_fallocate(fd, 0, *cur, next - *cur);
+		if (err)
+			return err;
+		if (step) {
+			/* keep the journal of the guest fs from piling up */
+			err = fsync_balloon(fd);
+			if (err)
+				return err;
+		}
+		*cur = next;
+
+		if (*cur < new_size)
+			ploop_log(1, "Inflated balloon %llu of %llu bytes",
+					(unsigned long long)*cur,
+					(unsigned long long)new_size);
+
+		if (rate && *cur < new_size) {
+			clock_gettime(CLOCK_MONOTONIC, &now);
+			elapsed = (now.tv_sec - start.tv_sec) +
+				(now.tv_nsec - start.tv_nsec) / 1e9;
+			expected = (double)(*cur - old_size) / rate;
+			if (expected > elapsed)
+				usleep((expected - elapsed) * 1000000);
+		}
+	}
+
+	return 0;
+}
+
+static int do_inflate(int fd, int mntn_type, off_t old_size, off_t *new_size,
+		__u64 step, __u64 rate, int *drop_state, int *cancelled)
 {
 	struct stat st;
+	off_t cur = old_size;
 	int err;
 
 	*drop_state = 0;
@@ -245,9 +289,14 @@ static int do_inflate(int fd, int mntn_type, off_t old_size, off_t *new_size, in
 		ploop_err(0, "Error: unknown mntn_type (%u)", mntn_type);
 		return(SYSEXIT_PROTOCOL);
 	}
-	err = sys_fallocate(fd, 0, 0, *new_size);
+	if (step == 0 && rate == 0)
+		err = sys_fallocate(fd, 0, 0, *new_size);
+	else
+		err = inflate_steps(fd, &cur, *new_size, step, rate, cancelled);
 	if (err)
 		ploop_err(errno, "Can't fallocate balloon");
+	if (*cancelled)
+		*new_size = cur;
 
 	if (fstat(fd, &st)) {
 		ploop_err(errno, "Can't stat balloon (2)");
@@ -288,6 +337,31 @@ static int do_inflate(int fd, int mntn_type, off_t old_size, off_t *new_size, in
 }
 
 int ploop_balloon_change_size(const char *device, int balloonfd, off_t new_size)
+{
+	return balloon_change_size(device, balloonfd, new_size, 0, 0);
+}
+
+/* @step and @rate, in bytes, make the inflation incremental, see
+ * inflate_steps(); 0 means the whole size at once and no limit.
+ */
+static int do_relocblks(int fd, const char *device,
+		struct ploop_relocblks_ctl *relocblks)
+{
+	int ret;
+
+	ret = ioctl_device(fd, PLOOP_IOC_RELOCBLKS, relocblks);
+	if (ret)
+		return ret;
+
+	/* The delta is truncated below the journal checkpoint, so the
+	 * blocks the kernel allocates from the new alloc head on would
+	 * not be journaled.
+	 */
+	return alloc_journal_drop_dev(device);
+}
+
+int balloon_change_size(const char *device, int balloonfd, off_t new_size,
+		__u64 step, __u64 rate)
 {
 	int    fd = -1;
 	int    ret;
@@ -303,12 +377,12 @@ int ploop_balloon_change_size(const char *device, int balloonfd, off_t new_size)
 	struct relocmap		   *relocmap = NULL;
 	struct ploop_freeblks_ctl  *freeblks = NULL;
 	struct ploop_relocblks_ctl *relocblks = NULL;
-	__u32 *reverse_map = NULL;
-	__u32  reverse_map_len;
+	struct rmap *reverse_map = NULL;
 	int top_level;
 	struct delta delta = { .fd = -1 };
 	int entries_used;
 	int drop_state = 0;
+	int cancelled = 0;
 
 	if (fstat(balloonfd, &st)) {
 		ploop_err(errno, "Can't get balloon file size");
@@ -361,12 +435,12 @@ int ploop_balloon_change_size(const char *device, int balloonfd, off_t new_size)
 	if (ret)
 		goto err;
 
-	ret = do_inflate(balloonfd, b_ctl.mntn_type, old_size, &new_size, &drop_state);
+	ret = do_inflate(balloonfd, b_ctl.mntn_type, old_size, &new_size,
+			step, rate, &drop_state, &cancelled);
 	if (ret)
 		goto err;
 
-	reverse_map_len = delta.l2_size + delta.l2_size;
-	reverse_map = alloc_reverse_map(reverse_map_len);
+	reverse_map = rmap_alloc(delta.l2_size + delta.l2_size);
 	if (reverse_map == NULL) {
 		ret = SYSEXIT_MALLOC;
 		goto err;
@@ -376,11 +450,11 @@ int ploop_balloon_change_size(const char *device, int balloonfd, off_t new_size)
 	if (ret)
 		goto err;
 	fiemap_adjust(pfiemap, delta.blocksize);
-	ret = fiemap_build_rmap(pfiemap, reverse_map, reverse_map_len, &delta);
+	ret = fiemap_build_rmap(pfiemap, reverse_map, &delta);
 	if (ret)
 		goto err;
 
-	ret = rmap2freemap(reverse_map, 0, reverse_map_len, &freemap, &entries_used);
+	ret = rmap2freemap(reverse_map, 0, reverse_map->len, &freemap, &entries_used);
 	if (ret)
 		goto err;
 	if (entries_used == 0) {
@@ -390,20 +464,23 @@ int ploop_balloon_change_size(const char *device, int balloonfd, off_t new_size)
 	}
 
 	ret = freemap2freeblks(freemap, top_level, &freeblks, &n_free_blocks);
+	if (ret)
+		goto err;
+	ret = alloc_journal_add_freeblks(device, freeblks);
 	if (ret)
 		goto err;
 	ret = ioctl_device(fd, PLOOP_IOC_FREEBLKS, freeblks);
 	if (ret)
 		goto err;
 	freezed_a_h = freeblks->alloc_head;
-	if (freezed_a_h > reverse_map_len) {
+	if (freezed_a_h > reverse_map->len) {
 		ploop_err(0, "Image corrupted: a_h=%u > rlen=%u",
-			freezed_a_h, reverse_map_len);
+			freezed_a_h, reverse_map->len);
 		ret = SYSEXIT_PLOOPFMT;
 		goto err;
 	}
 
-	ret = range_build(freezed_a_h, n_free_blocks, reverse_map, reverse_map_len,
+	ret = range_build(freezed_a_h, n_free_blocks, reverse_map,
 		    &delta, freemap, &rangemap, &relocmap);
 	if (ret)
 		goto err;
@@ -412,14 +489,15 @@ int ploop_balloon_change_size(const char *device, int balloonfd, off_t new_size)
 			   &relocblks);
 	if (ret)
 		goto err;
-	ret = ioctl_device(fd, PLOOP_IOC_RELOCBLKS, relocblks);
+	ret = do_relocblks(fd, device, relocblks);
 	if (ret)
 		goto err;
 	ploop_log(0, "TRUNCATED: %u cluster-blocks (%llu bytes)",
 			relocblks->alloc_head,
 			(unsigned long long)(relocblks->alloc_head * S2B(delta.blocksize)));
 out:
-	ret = 0;
+	/* the balloon is consistent at its partial size */
+	ret = cancelled ? SYSEXIT_ABORT : 0;
 err:
 	if (drop_state) {
 		memset(&b_ctl, 0, sizeof(b_ctl));
@@ -431,7 +509,7 @@ err:
 	free(freemap);
 	free(rangemap);
 	free(relocmap);
-	free(reverse_map);
+	rmap_free(reverse_map);
 	free(freeblks);
 	free(relocblks);
 	if (delta.fd != -1)
@@ -488,7 +566,11 @@ err:
 	return ret;
 }
 
-static int ploop_balloon_relocation(int fd, struct ploop_balloon_ctl *b_ctl, const char *device)
+/* @idx_p is the reverse index kept between the rounds of a discard
+ * session, NULL for a one-shot relocation
+ */
+static int ploop_balloon_relocation(int fd, struct ploop_balloon_ctl *b_ctl,
+		const char *device, struct reloc_index **idx_p)
 {
 	int    ret = -1;
 	__u32  n_free_blocks = 0;
@@ -498,10 +580,9 @@ static int ploop_balloon_relocation(int fd, struct ploop_balloon_ctl *b_ctl, con
 	struct relocmap		   *relocmap = NULL;
 	struct ploop_freeblks_ctl  *freeblks = NULL;
 	struct ploop_relocblks_ctl *relocblks = NULL;;
-	__u32 *reverse_map = NULL;
-	__u32  reverse_map_len;
+	struct rmap *reverse_map = NULL;
 	int top_level;
-	struct delta delta = {};
+	struct delta delta = { .fd = -1 };
 
 	freemap  = freemap_alloc(128);
 	rangemap = freemap_alloc(128);
@@ -548,17 +629,18 @@ static int ploop_balloon_relocation(int fd, struct ploop_balloon_ctl *b_ctl, con
 	ret = open_top_delta(device, &delta, &top_level);
 	if (ret)
 		goto err;
-	reverse_map_len = delta.l2_size + delta.l2_size;
-	reverse_map = alloc_reverse_map(reverse_map_len);
+	reverse_map = rmap_alloc(delta.l2_size + delta.l2_size);
 	if (reverse_map == NULL) {
-		close_delta(&delta);
 		ret = SYSEXIT_MALLOC;
 		goto err;
 	}
 
-	ret = range_build(freezed_a_h, n_free_blocks, reverse_map, reverse_map_len,
-		    &delta, freemap, &rangemap, &relocmap);
-	close_delta(&delta);
+	if (idx_p != NULL)
+		ret = range_build_indexed(idx_p, freezed_a_h, n_free_blocks,
+				reverse_map, &delta, freemap, &rangemap, &relocmap);
+	else
+		ret = range_build(freezed_a_h, n_free_blocks, reverse_map,
+				&delta, freemap, &rangemap, &relocmap);
 	if (ret)
 		goto err;
 reloc:
@@ -566,19 +648,29 @@ reloc:
 			   &relocblks);
 	if (ret)
 		goto err;
-	ret = ioctl_device(fd, PLOOP_IOC_RELOCBLKS, relocblks);
+	ret = do_relocblks(fd, device, relocblks);
 	if (ret)
 		goto err;
 
 	ploop_log(0, "TRUNCATED: %u cluster-blocks (%llu bytes)",
 			relocblks->alloc_head,
 			(unsigned long long)(relocblks->alloc_head * S2B(delta.blocksize)));
+
+	if (idx_p != NULL && *idx_p != NULL && delta.fd != -1 &&
+			reloc_index_update(*idx_p, relocmap,
+				relocblks->alloc_head, &delta)) {
+		/* not fatal, the next round rebuilds it */
+		reloc_index_free(*idx_p);
+		*idx_p = NULL;
+	}
 err:
+	if (delta.fd != -1)
+		close_delta(&delta);
 
 	free(freemap);
 	free(rangemap);
 	free(relocmap);
-	free(reverse_map);
+	rmap_free(reverse_map);
 	free(freeblks);
 	free(relocblks);
 
@@ -626,7 +718,7 @@ int ploop_balloon_complete(const char *device)
 		goto out;
 	}
 
-	err = ploop_balloon_relocation(fd, &b_ctl, device);
+	err = ploop_balloon_relocation(fd, &b_ctl, device, NULL);
 out:
 	close(fd);
 	return err;
@@ -648,8 +740,7 @@ int ploop_balloon_check_and_repair(const char *device, const char *mount_point,
 	struct ploop_freeblks_ctl  *freeblks = NULL;
 	struct ploop_relocblks_ctl *relocblks= NULL;
 	char *msg = repair ? "repair" : "check";
-	__u32 *reverse_map = NULL;
-	__u32  reverse_map_len;
+	struct rmap *reverse_map = NULL;
 	int top_level;
 	int entries_used;
 	struct delta delta = {};
@@ -693,8 +784,7 @@ int ploop_balloon_check_and_repair(const char *device, const char *mount_point,
 		ret = open_top_delta(device, &delta, &top_level);
 		if (ret)
 			goto err;
-		reverse_map_len = delta.l2_size + delta.l2_size;
-		reverse_map = alloc_reverse_map(reverse_map_len);
+		reverse_map = rmap_alloc(delta.l2_size + delta.l2_size);
 		if (reverse_map == NULL) {
 			ret = SYSEXIT_MALLOC;
 			goto err;
@@ -741,11 +831,11 @@ int ploop_balloon_check_and_repair(const char *device, const char *mount_point,
 		goto err;
 	fiemap_adjust(pfiemap, delta.blocksize);
 
-	ret = fiemap_build_rmap(pfiemap, reverse_map, reverse_map_len, &delta);
+	ret = fiemap_build_rmap(pfiemap, reverse_map, &delta);
 	if (ret)
 		goto err;
 
-	ret = rmap2freemap(reverse_map, 0, reverse_map_len, &freemap, &entries_used);
+	ret = rmap2freemap(reverse_map, 0, reverse_map->len, &freemap, &entries_used);
 	if (ret)
 		goto err;
 	if (entries_used == 0) {
@@ -765,19 +855,22 @@ int ploop_balloon_check_and_repair(const char *device, const char *mount_point,
 		ploop_log(0, "Found %u free blocks", n_free_blocks);
 	}
 
+	ret = alloc_journal_add_freeblks(device, freeblks);
+	if (ret)
+		goto err;
 	ret = ioctl_device(fd, PLOOP_IOC_FREEBLKS, freeblks);
 	if (ret)
 		goto err;
 	drop_state = 0;
 	freezed_a_h = freeblks->alloc_head;
-	if (freezed_a_h > reverse_map_len) {
+	if (freezed_a_h > reverse_map->len) {
 		ploop_err(0, "Image corrupted: a_h=%u > rlen=%u",
-			freezed_a_h, reverse_map_len);
+			freezed_a_h, reverse_map->len);
 		ret = SYSEXIT_PLOOPFMT;
 		goto err;
 	}
 
-	ret = range_build(freezed_a_h, n_free_blocks, reverse_map, reverse_map_len,
+	ret = range_build(freezed_a_h, n_free_blocks, reverse_map,
 		    &delta, freemap, &rangemap, &relocmap);
 	if (ret)
 		goto err;
@@ -786,7 +879,7 @@ int ploop_balloon_check_and_repair(const char *device, const char *mount_point,
 			   &relocblks);
 	if (ret)
 		goto err;
-	ret = ioctl_device(fd, PLOOP_IOC_RELOCBLKS, relocblks);
+	ret = do_relocblks(fd, device, relocblks);
 	if (ret)
 		goto err;
 
@@ -809,17 +902,47 @@ err:
 	free(freemap);
 	free(rangemap);
 	free(relocmap);
-	free(reverse_map);
+	rmap_free(reverse_map);
 	free(freeblks);
 	free(relocblks);
 
 	return ret;
 }
 
-static int trim_stop = 0;
-static void stop_trim_handler(int sig)
+/* The trim worker is a thread of the process doing the relocation.
+ * It is asked to stop via stop_fd and reports its completion via
+ * done_fd, both are eventfds.
+ */
+struct discard_worker {
+	pthread_t tid;
+	int fd;
+	const char *mount_point;
+	__u64 minlen_b;
+	__u32 cluster;
+	__u64 dev_off;
+	__u64 to_free_b;
+	__u64 *blk_discard_range;
+	int stop_fd;
+	int done_fd;
+	int ret;
+};
+
+static int discard_stopped(int stop_fd)
 {
-	trim_stop = 1;
+	struct pollfd pfd = {
+		.fd = stop_fd,
+		.events = POLLIN,
+	};
+
+	return poll(&pfd, 1, 0) > 0;
+}
+
+static void discard_notify(int efd)
+{
+	eventfd_t v = 1;
+
+	if (eventfd_write(efd, v))
+		ploop_err(errno, "eventfd_write");
 }
 
 static void cancel_discard(void *data)
@@ -830,21 +953,266 @@ static void cancel_discard(void *data)
 /* The fragmentation of such blocks doesn't affect the speed of w/r */
 #define MAX_DISCARD_CLU 32
 
-static int ploop_trim(const char *mount_point, __u64 minlen_b, __u64 cluster)
+#ifndef FS_IOC_GETFSMAP
+/* from linux/fsmap.h */
+struct fsmap {
+	__u32	fmr_device;
+	__u32	fmr_flags;
+	__u64	fmr_physical;
+	__u64	fmr_owner;
+	__u64	fmr_offset;
+	__u64	fmr_length;
+	__u64	fmr_reserved[3];
+};
+
+struct fsmap_head {
+	__u32	fmh_iflags;
+	__u32	fmh_oflags;
+	__u32	fmh_count;
+	__u32	fmh_entries;
+	__u64	fmh_reserved[6];
+	struct fsmap fmh_keys[2];
+	struct fsmap fmh_recs[];
+};
+
+#define FMR_OF_SPECIAL_OWNER	0x02
+#define FMR_OF_LAST		0x20
+#define FMR_OWN_FREE		((__u64)1)
+#define FS_IOC_GETFSMAP		_IOWR('X', 59, struct fsmap_head)
+#endif
+
+#define FSMAP_NR_RECS		1024
+#define TRIM_HIST_BUCKETS	32
+
+struct trim_extent {
+	__u64 start;
+	__u64 len;
+};
+
+struct trim_plan {
+	__u64 dev_off;		/* offset of the file system on the device */
+	int count_only;		/* fill the histogram only */
+	int n_extents;
+	int n_alloced;
+	struct trim_extent *extents;
+	__u64 total;
+	/* number and bytes of extents of [2^i, 2^(i+1)) clusters */
+	__u32 hist_n[TRIM_HIST_BUCKETS];
+	__u64 hist_b[TRIM_HIST_BUCKETS];
+};
+
+static int trim_plan_add(struct trim_plan *plan, __u64 start, __u64 len,
+		__u64 minlen_b, __u64 cluster)
 {
-	struct fstrim_range range = {0, ULLONG_MAX, 0};
-	int fd, ret = -1;
+	__u64 end = (plan->dev_off + start + len) / cluster * cluster;
+	int b;
 
-	struct sigaction sa = {
-		.sa_handler     = stop_trim_handler,
-	};
-	sigemptyset(&sa.sa_mask);
+	/* only whole clusters can be given back to the image */
+	start = (plan->dev_off + start + cluster - 1) / cluster * cluster;
+	if (end <= start || end - start < minlen_b)
+		return 0;
+	len = end - start;
+	start -= plan->dev_off;
+
+	for (b = 0; b < TRIM_HIST_BUCKETS - 1 && (len / cluster) >> (b + 1); b++)
+		;
+	plan->hist_n[b]++;
+	plan->hist_b[b] += len;
+	plan->total += len;
+
+	if (plan->count_only)
+		return 0;
+
+	if (plan->n_extents == plan->n_alloced) {
+		int n = plan->n_alloced ? plan->n_alloced * 2 : 1024;
+		struct trim_extent *t;
+
+		t = realloc(plan->extents, n * sizeof(struct trim_extent));
+		if (t == NULL) {
+			ploop_err(ENOMEM, "Can't alloc trim plan");
+			return -1;
+		}
+		plan->extents = t;
+		plan->n_alloced = n;
+	}
+
+	plan->extents[plan->n_extents].start = start;
+	plan->extents[plan->n_extents].len = len;
+	plan->n_extents++;
+
+	return 0;
+}
+
+static int trim_extent_cmp(const void *a, const void *b)
+{
+	const struct trim_extent *x = a, *y = b;
+
+	if (x->len != y->len)
+		return x->len < y->len ? 1 : -1;
+	return x->start < y->start ? -1 : x->start > y->start;
+}
+
+/* Collect the free extents of the file system on @fd.
+ * Returns 1 if the file system can't report them, for whatever reason;
+ * the callers do without the layout then.
+ */
+static int trim_plan_build(int fd, __u64 minlen_b, __u64 cluster,
+		struct trim_plan *plan, int stop_fd)
+{
+	struct fsmap_head *head;
+	struct fsmap *rec = NULL;
+	__u64 start = 0, len = 0;
+	__u32 i;
+	int ret = 0;
+
+	head = calloc(1, sizeof(struct fsmap_head) +
+			FSMAP_NR_RECS * sizeof(struct fsmap));
+	if (head == NULL) {
+		ploop_err(ENOMEM, "Can't alloc fsmap");
+		return -1;
+	}
+
+	head->fmh_count = FSMAP_NR_RECS;
+	head->fmh_keys[1].fmr_device = UINT_MAX;
+	head->fmh_keys[1].fmr_flags = UINT_MAX;
+	head->fmh_keys[1].fmr_physical = ULLONG_MAX;
+	head->fmh_keys[1].fmr_owner = ULLONG_MAX;
+	head->fmh_keys[1].fmr_offset = ULLONG_MAX;
+
+	while (!discard_stopped(stop_fd)) {
+		if (ioctl(fd, FS_IOC_GETFSMAP, head)) {
+			if (errno == ENOTTY || errno == EOPNOTSUPP ||
+					errno == EINVAL)
+				ploop_log(1, "GETFSMAP is not supported");
+			else
+				ploop_log(0, "Warning: GETFSMAP: %s",
+						strerror(errno));
+			ret = 1;
+			goto out;
+		}
+		if (head->fmh_entries == 0)
+			break;
+
+		for (i = 0; i < head->fmh_entries; i++) {
+			rec = &head->fmh_recs[i];
+			/* an inode number can be 1 too */
+			if (!(rec->fmr_flags & FMR_OF_SPECIAL_OWNER) ||
+					rec->fmr_owner != FMR_OWN_FREE)
+				continue;
+			/* free space is reported per block group, glue it */
+			if (len && start + len == rec->fmr_physical) {
+				len += rec->fmr_length;
+				continue;
+			}
+			ret = trim_plan_add(plan, start, len, minlen_b, cluster);
+			if (ret)
+				goto out;
+			start = rec->fmr_physical;
+			len = rec->fmr_length;
+		}
+		if (rec->fmr_flags & FMR_OF_LAST)
+			break;
+		head->fmh_keys[0] = *rec;
+	}
+
+	if (ret == 0)
+		ret = trim_plan_add(plan, start, len, minlen_b, cluster);
+out:
+	free(head);
+
+	return ret;
+}
+
+static void trim_plan_log(struct trim_plan *plan, __u64 cluster)
+{
+	int i;
+
+	ploop_log(0, "Found %d free extents, %llu bytes",
+			plan->n_extents, (unsigned long long)plan->total);
+	for (i = 0; i < TRIM_HIST_BUCKETS; i++)
+		if (plan->hist_n[i])
+			ploop_log(1, "  >= %llu clusters: %u extents, %llu bytes",
+					1ULL << i, plan->hist_n[i],
+					(unsigned long long)plan->hist_b[i]);
+}
+
+/* Offset of the file system mounted at @mount_point on the ploop device */
+static int get_fs_dev_off(const char *device, const char *mount_point,
+		__u64 *off)
+{
+	struct stat st;
+	__u32 dev_start;
 
-	if (sigaction(SIGUSR1, &sa, NULL)) {
-		ploop_err(errno, "Can't set signal handler");
-		exit(1);
+	if (stat(mount_point, &st)) {
+		ploop_err(errno, "Can't stat %s", mount_point);
+		return SYSEXIT_FSTAT;
 	}
 
+	if (dev_num2dev_start(device, st.st_dev, &dev_start)) {
+		ploop_err(0, "Can't find out offset from start of ploop "
+			"device (%s) to start of partition", device);
+		return SYSEXIT_SYSFS;
+	}
+	*off = S2B(dev_start);
+
+	return 0;
+}
+
+/* Trim the free extents largest-first until @to_free_b bytes are
+ * discarded. Returns 1 if the free space layout is not available.
+ */
+static int ploop_trim_planned(int fd, __u64 minlen_b, __u64 cluster,
+		__u64 dev_off, __u64 to_free_b, int stop_fd)
+{
+	struct trim_plan plan = { .dev_off = dev_off };
+	__u64 trimmed = 0;
+	int i, ret;
+
+	ret = trim_plan_build(fd, minlen_b, cluster, &plan, stop_fd);
+	if (ret)
+		goto out;
+
+	trim_plan_log(&plan, cluster);
+	qsort(plan.extents, plan.n_extents, sizeof(struct trim_extent),
+			trim_extent_cmp);
+
+	for (i = 0; i < plan.n_extents && !discard_stopped(stop_fd); i++) {
+		struct fstrim_range range = {
+			.start = plan.extents[i].start,
+			.len = plan.extents[i].len,
+			.minlen = minlen_b,
+		};
+
+		ploop_log(3, "Call FITRIM, start=%llu len=%llu", range.start,
+				range.len);
+		if (ioctl(fd, FITRIM, &range) < 0) {
+			if (discard_stopped(stop_fd))
+				break;
+			ploop_err(errno, "Can't trim file system");
+			ret = -1;
+			break;
+		}
+
+		/* the kernel returns the number of bytes trimmed */
+		trimmed += range.len;
+		if (trimmed >= to_free_b)
+			break;
+	}
+	ploop_log(1, "Trimmed %llu bytes in %d ranges",
+			(unsigned long long)trimmed, i);
+
+out:
+	free(plan.extents);
+
+	return ret;
+}
+
+static int ploop_trim(const char *mount_point, __u64 minlen_b, __u64 cluster,
+		__u64 dev_off, __u64 to_free_b, int stop_fd)
+{
+	struct fstrim_range range = {0, ULLONG_MAX, 0};
+	int fd, ret = -1;
+
 	fd = open(mount_point, O_RDONLY);
 	if (fd < 0) {
 		ploop_err(errno, "Can't open mount point %s", mount_point);
@@ -857,13 +1225,21 @@ static int ploop_trim(const char *mount_point, __u64 minlen_b, __u64 cluster)
 		minlen_b = cluster;
 	else
 		minlen_b = (minlen_b + cluster - 1) / cluster * cluster;
+
+	ret = ploop_trim_planned(fd, minlen_b, cluster, dev_off, to_free_b,
+			stop_fd);
+	if (ret != 1)
+		goto out;
+
+	ret = 0;
 	range.minlen = MAX(MAX_DISCARD_CLU * cluster, minlen_b);
 
-	for (; range.minlen >= minlen_b; range.minlen /= 2) {
+	for (; range.minlen >= minlen_b && !discard_stopped(stop_fd);
+			range.minlen /= 2) {
 		ploop_log(1, "Call FITRIM, for minlen=%lld", range.minlen);
 		ret = ioctl(fd, FITRIM, &range);
 		if (ret < 0) {
-			if (trim_stop)
+			if (discard_stopped(stop_fd))
 				ret = 0;
 			else
 				ploop_err(errno, "Can't trim file system");
@@ -875,16 +1251,18 @@ static int ploop_trim(const char *mount_point, __u64 minlen_b, __u64 cluster)
 			range.minlen = minlen_b * 2;
 	}
 
+out:
 	close(fd);
 
 	return ret;
 }
 
-static int blk_discard(int fd, __u32 cluster, __u64 start, __u64 len)
+static int blk_discard(int fd, __u32 cluster, __u64 start, __u64 len,
+		int stop_fd)
 {
 	__u64 max_discard_len = S2B(B2S(UINT_MAX) / cluster * cluster);
 
-	while (len > 0) {
+	while (len > 0 && !discard_stopped(stop_fd)) {
 		__u64 range[2];
 		int ret;
 
@@ -897,7 +1275,7 @@ static int blk_discard(int fd, __u32 cluster, __u64 start, __u64 len)
 		ploop_log(1, "Call BLKDISCARD start=%llu length=%llu ", range[0], range[1]);
 		ret = ioctl_device(fd, BLKDISCARD, range);
 		if (ret)
-			return ret;
+			return discard_stopped(stop_fd) ? 0 : ret;
 
 		start += range[1];
 		len -= range[1];
@@ -906,15 +1284,98 @@ static int blk_discard(int fd, __u32 cluster, __u64 start, __u64 len)
 	return 0;
 }
 
+static void *discard_worker_fn(void *data)
+{
+	struct discard_worker *w = data;
+
+	if (w->blk_discard_range != NULL)
+		w->ret = blk_discard(w->fd, w->cluster, w->blk_discard_range[0],
+				w->blk_discard_range[1], w->stop_fd);
+	else
+		w->ret = ploop_trim(w->mount_point, w->minlen_b, w->cluster,
+				w->dev_off, w->to_free_b, w->stop_fd);
+	/* wakes up PLOOP_IOC_DISCARD_WAIT in the relocation loop */
+	if (ioctl_device(w->fd, PLOOP_IOC_DISCARD_FINI, NULL))
+		ploop_err(errno, "Can't finalize discard mode");
+
+	discard_notify(w->done_fd);
+
+	return NULL;
+}
+
+static int discard_worker_start(struct discard_worker *w)
+{
+	int ret;
+
+	w->stop_fd = eventfd(0, EFD_CLOEXEC);
+	w->done_fd = eventfd(0, EFD_CLOEXEC);
+	if (w->stop_fd == -1 || w->done_fd == -1) {
+		ploop_err(errno, "Can't create eventfd");
+		goto err;
+	}
+
+	ret = pthread_create(&w->tid, NULL, discard_worker_fn, w);
+	if (ret) {
+		ploop_err(ret, "Can't create the trim worker");
+		goto err;
+	}
+
+	return 0;
+
+err:
+	if (w->stop_fd != -1)
+		close(w->stop_fd);
+	if (w->done_fd != -1)
+		close(w->done_fd);
+	return SYSEXIT_SYS;
+}
+
+static int discard_worker_wait(struct discard_worker *w)
+{
+	struct pollfd pfd = {
+		.fd = w->done_fd,
+		.events = POLLIN,
+	};
+	int ret;
+
+	while ((ret = poll(&pfd, 1, 10000)) <= 0) {
+		if (ret == -1 && errno != EINTR) {
+			ploop_err(errno, "poll");
+			break;
+		}
+		if (ret == 0)
+			ploop_log(0, "Waiting for the trim worker to finish");
+	}
+
+	pthread_join(w->tid, NULL);
+	close(w->stop_fd);
+	close(w->done_fd);
+
+	if (w->ret) {
+		ploop_err(0, "The trim worker failed with code %d", w->ret);
+		return -1;
+	}
+
+	return 0;
+}
+
 static int __ploop_discard(struct ploop_disk_images_data *di, int fd,
 			const char *device, const char *mount_point,
 			__u64 minlen_b, __u32 cluster, __u32 to_free,
 			__u64 blk_discard_range[2], const int *stop)
 {
-	pid_t tpid;
-	int err = 0, ret, status;
+	struct discard_worker w = {
+		.fd = fd,
+		.mount_point = mount_point,
+		.minlen_b = minlen_b,
+		.cluster = cluster,
+		.to_free_b = (__u64)to_free * cluster,
+		.blk_discard_range = blk_discard_range,
+	};
+	int err = 0, ret;
 	__u32 size = 0;
 	struct ploop_cleanup_hook *h;
+	struct reloc_index *idx = NULL;
 
 	if (blk_discard_range != NULL)
 		ploop_log(0, "Discard %s start=%llu length=%llu",
@@ -922,6 +1383,17 @@ static int __ploop_discard(struct ploop_disk_images_data *di, int fd,
 	else
 		ploop_log(3, "Trying to find free extents bigger than %llu bytes", minlen_b);
 
+	if (mount_point != NULL) {
+		ret = get_fs_dev_off(device, mount_point, &w.dev_off);
+		if (ret)
+			return ret;
+	}
+
+	/* blocks reused by the kernel after discard are not journaled */
+	ret = alloc_journal_drop_dev(device);
+	if (ret)
+		return ret;
+
 	if (ploop_lock_di(di))
 		return SYSEXIT_LOCK;
 	ret = ioctl_device(fd, PLOOP_IOC_DISCARD_INIT, NULL);
@@ -931,29 +1403,15 @@ static int __ploop_discard(struct ploop_disk_images_data *di, int fd,
 		return ret;
 	}
 
-	tpid = fork();
-	if (tpid < 0) {
-		ploop_err(errno, "Can't fork");
-		ret = ioctl_device(fd, PLOOP_IOC_DISCARD_FINI, NULL);
-		if (ret) {
+	ret = discard_worker_start(&w);
+	if (ret) {
+		if (ioctl_device(fd, PLOOP_IOC_DISCARD_FINI, NULL))
 			ploop_err(errno, "Can't finalize discard mode");
-			return ret;
-		}
+		return ret;
 	}
 
 	h = register_cleanup_hook(cancel_discard, (void *) device);
 
-	if (tpid == 0) {
-		if (blk_discard_range != NULL)
-			ret = blk_discard(fd, cluster, blk_discard_range[0], blk_discard_range[1]);
-		else
-			ret = ploop_trim(mount_point, minlen_b, cluster);
-		if (ioctl_device(fd, PLOOP_IOC_DISCARD_FINI, NULL))
-			ploop_err(errno, "Can't finalize discard mode");
-
-		exit(ret != 0);
-	}
-
 	while (1) {
 		struct ploop_balloon_ctl b_ctl;
 
@@ -1003,15 +1461,15 @@ static int __ploop_discard(struct ploop_disk_images_data *di, int fd,
 		}
 
 		if (size >= to_free || (stop && *stop)) {
-			ploop_log(3, "Killing the trim process %d", tpid);
-			kill(tpid, SIGUSR1);
+			ploop_log(3, "Stopping the trim worker");
+			discard_notify(w.stop_fd);
 			ret = ioctl(fd, PLOOP_IOC_DISCARD_FINI);
 			if (ret < 0 && errno != EBUSY)
 				ploop_err(errno, "Can't finalize a discard mode");
 		}
 
 		ploop_log(0, "Starting relocation");
-		ret = ploop_balloon_relocation(fd, &b_ctl, device);
+		ret = ploop_balloon_relocation(fd, &b_ctl, device, &idx);
 		ploop_unlock_di(di);
 		if (ret)
 			break;
@@ -1029,33 +1487,16 @@ static int __ploop_discard(struct ploop_disk_images_data *di, int fd,
 				ploop_err(errno, "Can't finalize discard mode");
 		}
 
-		kill(tpid, SIGKILL);
+		discard_notify(w.stop_fd);
 	} else {
 		ploop_log(0, "%d clusters have been relocated", size);
 	}
 
 	unregister_cleanup_hook(h);
+	reloc_index_free(idx);
 
-	while ((ret = waitpid(tpid, &status, 0)))
-		 if (errno != EINTR)
-			break;
-	if (ret == -1) {
-		if (errno != ECHILD)
-			ploop_err(errno, "wait() failed");
-		err = -1;
-	} else if (WIFEXITED(status)) {
-		ret = WEXITSTATUS(status);
-		if (ret) {
-			ploop_err(0, "The trim process failed with code %d", ret);
-			err = -1;
-		}
-	} else if (WIFSIGNALED(status)) {
-		ploop_err(0, "The trim process killed by signal %d", WTERMSIG(status));
-		err = -1;
-	} else {
-		ploop_err(0, "The trim process died abnormally");
+	if (discard_worker_wait(&w))
 		err = -1;
-	}
 
 	return err;
 }
@@ -1298,6 +1739,70 @@ int ploop_discard_get_stat_by_dev(const char *device, const char *mount_point,
 	return 0;
 }
 
+int ploop_discard_get_stat_ex_by_dev(const char *device, const char *mount_point,
+		struct ploop_discard_stat_ex *pd_stat)
+{
+	int fd, i, ret, blocksize;
+	__u64 sum = 0;
+	struct trim_plan plan = { .count_only = 1 };
+
+	memset(pd_stat, 0, sizeof(*pd_stat));
+	ret = ploop_discard_get_stat_by_dev(device, mount_point, &pd_stat->stat);
+	if (ret)
+		return ret;
+
+	if (ploop_get_attr(device, "block_size", &blocksize)) {
+		ploop_err(0, "Can't find block size");
+		return SYSEXIT_SYSFS;
+	}
+	pd_stat->cluster = S2B(blocksize);
+
+	/* the histogram is optional, without it only the basic stat is
+	 * returned and hist_valid stays 0
+	 */
+	if (get_fs_dev_off(device, mount_point, &plan.dev_off))
+		return 0;
+
+	fd = open(mount_point, O_RDONLY);
+	if (fd < 0) {
+		ploop_log(0, "Warning: can't open mount point %s: %s",
+				mount_point, strerror(errno));
+		return 0;
+	}
+	ret = trim_plan_build(fd, pd_stat->cluster, pd_stat->cluster, &plan, -1);
+	close(fd);
+	if (ret) {
+		pd_stat->hist_valid = 0;
+		return 0;
+	}
+
+	for (i = PLOOP_FREE_HIST_SIZE - 1; i >= 0; i--) {
+		if (i < TRIM_HIST_BUCKETS) {
+			pd_stat->free_extents[i] = plan.hist_n[i];
+			pd_stat->free_bytes[i] = plan.hist_b[i];
+		}
+		sum += pd_stat->free_bytes[i];
+		pd_stat->reclaimable[i] = sum;
+	}
+	pd_stat->hist_valid = 1;
+
+	return 0;
+}
+
+int ploop_discard_get_stat_ex(struct ploop_disk_images_data *di,
+		struct ploop_discard_stat_ex *pd_stat)
+{
+	int ret;
+	char dev[PATH_MAX];
+	char mnt[PATH_MAX];
+
+	ret = ploop_get_dev_and_mnt(di, dev, sizeof(dev), mnt, sizeof(mnt));
+	if (ret)
+		return ret;
+
+	return ploop_discard_get_stat_ex_by_dev(dev, mnt, pd_stat);
+}
+
 int ploop_discard_get_stat(struct ploop_disk_images_data *di,
 		struct ploop_discard_stat *pd_stat)
 {
@@ -35,11 +35,122 @@
 
 #define MIN(a, b) (a < b ? a : b)
 
-static void range_fix_gaps(struct freemap *freemap, __u32 iblk_start, __u32 iblk_end,
-		__u32 n_to_fix, __u32 *rmap);
+static int range_fix_gaps(struct freemap *freemap, __u32 iblk_start, __u32 iblk_end,
+		__u32 n_to_fix, struct rmap *rmap);
 static int range_split(struct freemap *rangemap, struct freemap *freemap,
 		struct relocmap **relocmap_pp);
 
+struct rmap *rmap_alloc(__u32 len)
+{
+	struct rmap *rmap;
+
+	rmap = calloc(1, sizeof(struct rmap));
+	if (rmap == NULL)
+		goto err;
+
+	rmap->len = len;
+	rmap->n_chunks = (len + RMAP_CHUNK_SIZE - 1) >> RMAP_CHUNK_BITS;
+	rmap->chunks = calloc(rmap->n_chunks ? rmap->n_chunks : 1,
+			sizeof(__u32 *));
+	if (rmap->chunks == NULL) {
+		free(rmap);
+		goto err;
+	}
+
+	return rmap;
+err:
+	ploop_err(errno, "Can't alloc reverse map");
+	return NULL;
+}
+
+static void rmap_clear(struct rmap *rmap)
+{
+	__u32 i;
+
+	for (i = 0; i < rmap->n_chunks; i++) {
+		free(rmap->chunks[i]);
+		rmap->chunks[i] = NULL;
+	}
+}
+
+void rmap_free(struct rmap *rmap)
+{
+	if (rmap == NULL)
+		return;
+
+	rmap_clear(rmap);
+	free(rmap->chunks);
+	free(rmap);
+}
+
+int rmap_set(struct rmap *rmap, __u32 iblk, __u32 clu)
+{
+	__u32 **chunk = &rmap->chunks[iblk >> RMAP_CHUNK_BITS];
+
+	if (*chunk == NULL) {
+		*chunk = malloc(RMAP_CHUNK_SIZE * sizeof(__u32));
+		if (*chunk == NULL) {
+			ploop_err(errno, "Can't alloc reverse map");
+			return SYSEXIT_MALLOC;
+		}
+		memset(*chunk, 0xff, RMAP_CHUNK_SIZE * sizeof(__u32));
+	}
+	(*chunk)[iblk & (RMAP_CHUNK_SIZE - 1)] = clu;
+
+	return 0;
+}
+
+/* The extent maps (pfiemap, freemap, relocmap) are arrays sorted by
+ * position, all starting with the same two counters. Sorted arrays give
+ * O(log n) lookups, and the kernel wants the extents in this very order.
+ * There is no O(log n) insert: extents are only ever appended, and the
+ * one map that is filled out of order (pfiemap) is sorted once.
+ */
+struct extmap_hdr {
+	int n_entries_alloced;
+	int n_entries_used;
+};
+
+/* Make room for one more extent, returns NULL if out of memory,
+ * in which case the map is left intact.
+ */
+static void *extmap_grow(void *map, size_t ext_off, size_t ext_size)
+{
+	struct extmap_hdr *hdr = map;
+	int n;
+
+	if (hdr->n_entries_used < hdr->n_entries_alloced)
+		return map;
+
+	n = hdr->n_entries_alloced ? hdr->n_entries_alloced * 2 : 16;
+	map = realloc(map, ext_off + n * ext_size);
+	if (map == NULL)
+		return NULL;
+
+	hdr = map;
+	hdr->n_entries_alloced = n;
+
+	return map;
+}
+
+/* Index of the first free extent ending after @iblk, looking at
+ * the extents from @from on
+ */
+static int freemap_lookup(struct freemap *freemap, int from, __u32 iblk)
+{
+	int lo = from, hi = freemap->n_entries_used, mid;
+
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		if (freemap->extents[mid].iblk + freemap->extents[mid].len <= iblk)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	return lo;
+}
+
 struct pfiemap *fiemap_alloc(int n)
 {
 	int len = offsetof(struct pfiemap, extents[n]);
@@ -55,43 +166,64 @@ struct pfiemap *fiemap_alloc(int n)
 	return pfiemap;
 }
 
+/* Append an extent, merging it with the last one if they are adjacent.
+ * FIEMAP returns the extents in file order, so the map is sorted by pos
+ * once, by fiemap_sort(), after all of them are added.
+ */
 static int fiemap_add_extent(struct pfiemap **pfiemap_pp, __u64 pos, __u64 len)
 {
-	int i;
 	struct pfiemap *pfiemap = *pfiemap_pp;
+	struct ploop_extent *ext;
+	int n = pfiemap->n_entries_used;
 
-	// XXX: not optimal - O(N**2) !!!
-	for (i = 0; i < pfiemap->n_entries_used; i++)
-		if (pfiemap->extents[i].pos + pfiemap->extents[i].len == pos) {
-			pfiemap->extents[i].len += len;
-			return 0;
-		} else if (pos + len == pfiemap->extents[i].pos) {
-			pfiemap->extents[i].pos = pos;
-			pfiemap->extents[i].len += len;
-			return 0;
-		}
-
-	if (pfiemap->n_entries_used == pfiemap->n_entries_alloced) {
-		i = pfiemap->n_entries_alloced * 2;
-
-		*pfiemap_pp = realloc(*pfiemap_pp, offsetof(struct pfiemap,
-							    extents[i]));
-		if (!*pfiemap_pp) {
-			ploop_err(errno, "Can't realloc pfiemap");
-			return(SYSEXIT_MALLOC);
-		}
+	if (n > 0 && pfiemap->extents[n - 1].pos +
+			pfiemap->extents[n - 1].len == pos) {
+		pfiemap->extents[n - 1].len += len;
+		return 0;
+	}
 
-		pfiemap = *pfiemap_pp;
-		pfiemap->n_entries_alloced = i;
+	pfiemap = extmap_grow(pfiemap, offsetof(struct pfiemap, extents),
+			sizeof(struct ploop_extent));
+	if (pfiemap == NULL) {
+		ploop_err(errno, "Can't realloc pfiemap");
+		return SYSEXIT_MALLOC;
 	}
+	*pfiemap_pp = pfiemap;
 
-	i = pfiemap->n_entries_used++;
-	pfiemap->extents[i].pos = pos;
-	pfiemap->extents[i].len = len;
+	ext = &pfiemap->extents[n];
+	ext->pos = pos;
+	ext->len = len;
+	pfiemap->n_entries_used++;
 
 	return 0;
 }
 
+static int fiemap_extent_cmp(const void *a, const void *b)
+{
+	const struct ploop_extent *x = a, *y = b;
+
+	return x->pos < y->pos ? -1 : x->pos > y->pos;
+}
+
+/* Sort the map by pos and merge the adjacent extents */
+static void fiemap_sort(struct pfiemap *pfiemap)
+{
+	struct ploop_extent *ext = pfiemap->extents;
+	int i, n = 0;
+
+	if (pfiemap->n_entries_used < 2)
+		return;
+
+	qsort(ext, pfiemap->n_entries_used, sizeof(*ext), fiemap_extent_cmp);
+	for (i = 1; i < pfiemap->n_entries_used; i++) {
+		if (ext[n].pos + ext[n].len == ext[i].pos)
+			ext[n].len += ext[i].len;
+		else
+			ext[++n] = ext[i];
+	}
+	pfiemap->n_entries_used = n + 1;
+}
+
 static char fieflags[256];
 static char *fl(__u32 fe_flags)
 {
@@ -119,7 +251,8 @@ static char *fl(__u32 fe_flags)
 	return fieflags;
 }
 
-int fiemap_get(int fd, __u64 off, __u64 start, off_t size, struct pfiemap **pfiemap_pp)
+static int fiemap_collect(int fd, __u64 off, __u64 start, off_t size,
+		struct pfiemap **pfiemap_pp)
 {
 	int  i;
 	int  rc;
@@ -205,6 +338,17 @@ int fiemap_get(int fd, __u64 off, __u64 start, off_t size, struct pfiemap **pfie
 	return 0;
 }
 
+int fiemap_get(int fd, __u64 off, __u64 start, off_t size, struct pfiemap **pfiemap_pp)
+{
+	int rc;
+
+	rc = fiemap_collect(fd, off, start, size, pfiemap_pp);
+	if (rc == 0)
+		fiemap_sort(*pfiemap_pp);
+
+	return rc;
+}
+
 void fiemap_adjust(struct pfiemap *pfiemap, __u32 blocksize)
 {
 	int i;
@@ -232,10 +376,12 @@ void fiemap_adjust(struct pfiemap *pfiemap, __u32 blocksize)
 	}
 }
 
-static int fiemap_extent_process(__u32 clu, __u32 len, __u32 *rmap, __u32 rlen,
+static int fiemap_extent_process(__u32 clu, __u32 len, struct rmap *rmap,
 				  struct delta *delta)
 {
 	__u64 cluster = S2B(delta->blocksize);
+	__u32 rlen = rmap->len;
+	int ret;
 
 	assert(cluster);
 
@@ -284,8 +430,11 @@ static int fiemap_extent_process(__u32 clu, __u32 len, __u32 *rmap, __u32 rlen,
 				return(SYSEXIT_PLOOPFMT);
 			}
 
-			rmap[ridx] = l2_cluster * (cluster / sizeof(__u32)) +
-				     j - PLOOP_MAP_OFFSET;
+			ret = rmap_set(rmap, ridx,
+				l2_cluster * (cluster / sizeof(__u32)) +
+				j - PLOOP_MAP_OFFSET);
+			if (ret)
+				return ret;
 		}
 
 		clu += (last - l2_slot);
@@ -294,7 +443,7 @@ static int fiemap_extent_process(__u32 clu, __u32 len, __u32 *rmap, __u32 rlen,
 	return 0;
 }
 
-int fiemap_build_rmap(struct pfiemap *pfiemap, __u32 *rmap, __u32 rlen,
+int fiemap_build_rmap(struct pfiemap *pfiemap, struct rmap *rmap,
 		       struct delta *delta)
 {
 	int i, rc;
@@ -302,7 +451,7 @@ int fiemap_build_rmap(struct pfiemap *pfiemap, __u32 *rmap, __u32 rlen,
 
 	assert(cluster);
 
-	memset(rmap, 0xff, rlen * sizeof(__u32));
+	rmap_clear(rmap);
 	delta->l2_cache = -1;
 
 	for(i = 0; i < pfiemap->n_entries_used; i++) {
@@ -317,7 +466,7 @@ int fiemap_build_rmap(struct pfiemap *pfiemap, __u32 *rmap, __u32 rlen,
 			return SYSEXIT_ABORT;
 		}
 
-		rc = fiemap_extent_process(clu, len, rmap, rlen, delta);
+		rc = fiemap_extent_process(clu, len, rmap, delta);
 		if (rc)
 			return rc;
 	}
@@ -343,21 +492,15 @@ static int freemap_add_extent(struct freemap **freemap_pp,
 			       __u32 clu, __u32 iblk, __u32 len)
 {
 	int i;
-	struct freemap *freemap = *freemap_pp;
-
-	if (freemap->n_entries_used == freemap->n_entries_alloced) {
-		i = freemap->n_entries_alloced * 2;
+	struct freemap *freemap;
 
-		*freemap_pp = realloc(*freemap_pp, offsetof(struct freemap,
-							    extents[i]));
-		if (!*freemap_pp) {
-			ploop_err(errno, "Can't realloc freemap");
-			return SYSEXIT_MALLOC;
-		}
-
-		freemap = *freemap_pp;
-		freemap->n_entries_alloced = i;
+	freemap = extmap_grow(*freemap_pp, offsetof(struct freemap, extents),
+			sizeof(struct ploop_free_cluster_extent));
+	if (freemap == NULL) {
+		ploop_err(errno, "Can't realloc freemap");
+		return SYSEXIT_MALLOC;
 	}
+	*freemap_pp = freemap;
 
 	i = freemap->n_entries_used++;
 	freemap->extents[i].clu = clu;
@@ -367,7 +510,7 @@ static int freemap_add_extent(struct freemap **freemap_pp,
 	return 0;
 }
 
-int rmap2freemap(__u32 *rmap, __u32 iblk_start, __u32 iblk_end,
+int rmap2freemap(struct rmap *rmap, __u32 iblk_start, __u32 iblk_end,
 		 struct freemap **freemap_pp, int *entries_used)
 {
 	__u32 iblk, clu;
@@ -378,7 +521,19 @@ int rmap2freemap(__u32 *rmap, __u32 iblk_start, __u32 iblk_end,
 	int   ret;
 
 	for (iblk = iblk_start; iblk < iblk_end; iblk++) {
-		clu = rmap[iblk];
+		/* skip absent chunks at once, they hold no extents */
+		if (rmap->chunks[iblk >> RMAP_CHUNK_BITS] == NULL) {
+			if (state) {
+				ret = freemap_add_extent(freemap_pp, e_clu, e_iblk, e_len);
+				if (ret)
+					return ret;
+				e_clu = e_iblk = 0;
+				state = 0;
+			}
+			iblk |= RMAP_CHUNK_SIZE - 1;
+			continue;
+		}
+		clu = rmap_get(rmap, iblk);
 
 		if ((clu == PLOOP_ZERO_INDEX && state) ||
 		    (clu != PLOOP_ZERO_INDEX && state &&
@@ -490,9 +645,11 @@ int freeblks2freemap(struct ploop_freeblks_ctl *freeblks,
 }
 
 static int range_build_rmap(__u32 iblk_start, __u32 iblk_end,
-		       __u32 *rmap, __u32 rlen, struct delta *delta, __u32 *out)
+		       struct rmap *rmap, struct delta *delta, __u32 *out)
 {
 	__u32 clu;
+	__u32 rlen = rmap->len;
+	int ret;
 	__u32 n_found = 0;
 	__u32 n_requested = iblk_end - iblk_start;
 	__u64 cluster = S2B(delta->blocksize);
@@ -509,7 +666,7 @@ static int range_build_rmap(__u32 iblk_start, __u32 iblk_end,
 		return SYSEXIT_ABORT;
 	}
 
-	memset(rmap, 0xff, rlen * sizeof(__u32));
+	rmap_clear(rmap);
 	delta->l2_cache = -1;
 
 	for (clu = 0; clu < delta->l2_size; clu++) {
@@ -550,8 +707,11 @@ static int range_build_rmap(__u32 iblk_start, __u32 iblk_end,
 		}
 
 		if (iblk_start <= ridx && ridx < iblk_end) {
-			rmap[ridx] = l2_cluster * (cluster / sizeof(__u32)) +
-				     l2_slot - PLOOP_MAP_OFFSET;
+			ret = rmap_set(rmap, ridx,
+				l2_cluster * (cluster / sizeof(__u32)) +
+				l2_slot - PLOOP_MAP_OFFSET);
+			if (ret)
+				return ret;
 			n_found++;
 			if (n_found >= n_requested)
 				break;
@@ -562,8 +722,34 @@ static int range_build_rmap(__u32 iblk_start, __u32 iblk_end,
 	return 0;
 }
 
+static int range_build_finish(__u32 s, __u32 a_h, __u32 n,
+		__u32 n_free_blocks,
+		struct rmap *rmap,
+		struct freemap   *freemap,
+		struct freemap  **rangemap_pp,
+		struct relocmap **relocmap_pp)
+{
+	int ret;
+	int entries_used;
+
+	if (n != n_free_blocks) {
+		ret = range_fix_gaps(freemap, s, a_h, n_free_blocks - n, rmap);
+		if (ret)
+			return ret;
+	}
+
+	ret = rmap2freemap(rmap, s, a_h, rangemap_pp, &entries_used);
+	if (ret)
+		return ret;
+	ret = range_split(*rangemap_pp, freemap, relocmap_pp);
+	if (ret)
+		return ret;
+
+	return 0;
+}
+
 int range_build(__u32 a_h, __u32 n_free_blocks,
-		__u32 *rmap, __u32 rlen,
+		struct rmap *rmap,
 		struct delta     *delta,
 		struct freemap   *freemap,
 		struct freemap  **rangemap_pp,
@@ -572,48 +758,232 @@ int range_build(__u32 a_h, __u32 n_free_blocks,
 	int ret;
 	__u32 s = a_h - n_free_blocks;
 	__u32 n;
-	int entries_used;
 
-	ret = range_build_rmap(s, a_h, rmap, rlen, delta, &n);
+	ret = range_build_rmap(s, a_h, rmap, delta, &n);
 	if (ret)
 		return ret;
 
-	if (n != n_free_blocks)
-		range_fix_gaps(freemap, s, a_h, n_free_blocks - n, rmap);
+	return range_build_finish(s, a_h, n, n_free_blocks, rmap,
+			freemap, rangemap_pp, relocmap_pp);
+}
 
-	ret = rmap2freemap(rmap, s, a_h, rangemap_pp, &entries_used);
-	if (ret)
-		return ret;
-	ret = range_split(*rangemap_pp, freemap, relocmap_pp);
-	if (ret)
+/* Relocation index.
+ *
+ * Every discard round relocates the blocks in [a_h - n_free, a_h) and
+ * range_build() finds their owners by scanning the whole L2 table. The
+ * index keeps the iblk -> clu map of a window below a_h built by one scan,
+ * and is fixed up from the relocmap after each PLOOP_IOC_RELOCBLKS, so the
+ * following rounds only have to read the L2 entries of the blocks they
+ * move. An entry which does not match the L2 or a range not covered by
+ * the window makes us rebuild the index.
+ */
+#define RELOC_INDEX_MIN_WINDOW	(16 * RMAP_CHUNK_SIZE)
+
+void reloc_index_free(struct reloc_index *idx)
+{
+	if (idx == NULL)
+		return;
+
+	rmap_free(idx->rmap);
+	free(idx);
+}
+
+static int read_l2_entry(struct delta *delta, __u32 clu, __u32 *iblk)
+{
+	__u64 cluster = S2B(delta->blocksize);
+	int l2_cluster = (clu + PLOOP_MAP_OFFSET) / (cluster / sizeof(__u32));
+	__u32 l2_slot = (clu + PLOOP_MAP_OFFSET) % (cluster / sizeof(__u32));
+
+	if (clu >= delta->l2_size || l2_cluster >= delta->l1_size) {
+		*iblk = 0;
+		return 0;
+	}
+
+	if (delta->l2_cache != l2_cluster) {
+		if (PREAD(delta, delta->l2, cluster, (off_t)l2_cluster * cluster))
+			return SYSEXIT_READ;
+		delta->l2_cache = l2_cluster;
+	}
+	*iblk = delta->l2[l2_slot] / ploop_sec_to_ioff(delta->blocksize,
+			delta->blocksize, delta->version);
+
+	return 0;
+}
+
+static int reloc_index_build(struct reloc_index **idx_p, __u32 s, __u32 a_h,
+		__u32 len, struct delta *delta)
+{
+	int ret;
+	__u32 n, window;
+	struct reloc_index *idx;
+
+	idx = calloc(1, sizeof(struct reloc_index));
+	if (idx == NULL) {
+		ploop_err(errno, "Can't alloc relocation index");
+		return SYSEXIT_MALLOC;
+	}
+
+	idx->rmap = rmap_alloc(len);
+	if (idx->rmap == NULL) {
+		free(idx);
+		return SYSEXIT_MALLOC;
+	}
+
+	window = 4 * (a_h - s);
+	if (window < RELOC_INDEX_MIN_WINDOW)
+		window = RELOC_INDEX_MIN_WINDOW;
+	idx->start = a_h > window ? a_h - window : 0;
+	idx->end = a_h;
+
+	ret = range_build_rmap(idx->start, idx->end, idx->rmap, delta, &n);
+	if (ret) {
+		reloc_index_free(idx);
 		return ret;
+	}
+
+	ploop_log(3, "relocation index [%u, %u) %u blocks",
+			idx->start, idx->end, n);
+	*idx_p = idx;
 
 	return 0;
 }
 
-static void range_fix_gaps(struct freemap *freemap, __u32 iblk_start, __u32 iblk_end,
-		    __u32 n_to_fix, __u32 *rmap)
+/* Fill @rmap for [s, a_h) from the index. *ok is set to 0 if the index
+ * can not be used for this range.
+ */
+static int reloc_index_lookup(struct reloc_index *idx, __u32 s, __u32 a_h,
+		struct rmap *rmap, struct delta *delta, struct freemap *freemap,
+		int fresh, __u32 *out, int *ok)
 {
-	__u32 ridx;
-	int   n = freemap->n_entries_used;
-	struct ploop_free_cluster_extent *fext	   = &freemap->extents[0];
-	struct ploop_free_cluster_extent *fext_end = &freemap->extents[n];
+	int i, ret;
+	__u32 iblk, clu, l2_iblk, n = 0, n_free = 0;
 
-	for (ridx = iblk_start; ridx < iblk_end; ridx++) {
-		if (rmap[ridx] != PLOOP_ZERO_INDEX)
+	*ok = 0;
+	if (s < idx->start || a_h > idx->end)
+		return 0;
+
+	/* free blocks are not owned by anybody, range_fix_gaps() handles them */
+	for (i = freemap_lookup(freemap, 0, idx->start);
+			i < freemap->n_entries_used; i++) {
+		struct ploop_free_cluster_extent *fext = &freemap->extents[i];
+
+		if (fext->iblk >= idx->end)
+			break;
+		for (iblk = fext->iblk; iblk < fext->iblk + fext->len; iblk++) {
+			if (iblk < idx->start || iblk >= idx->end)
+				continue;
+			if (rmap_get(idx->rmap, iblk) != PLOOP_ZERO_INDEX) {
+				ret = rmap_set(idx->rmap, iblk, PLOOP_ZERO_INDEX);
+				if (ret)
+					return ret;
+			}
+			if (s <= iblk && iblk < a_h)
+				n_free++;
+		}
+	}
+
+	rmap_clear(rmap);
+	delta->l2_cache = -1;
+	for (iblk = s; iblk < a_h; iblk++) {
+		clu = rmap_get(idx->rmap, iblk);
+		if (clu == PLOOP_ZERO_INDEX)
 			continue;
 
-		while (fext < fext_end && fext->iblk + fext->len <= ridx)
-			fext++;
-		if (fext == fext_end)
-			return;
+		if (!fresh) {
+			ret = read_l2_entry(delta, clu, &l2_iblk);
+			if (ret)
+				return ret;
+			if (l2_iblk != iblk) {
+				ploop_log(3, "relocation index is stale at %u", iblk);
+				return 0;
+			}
+		}
+
+		ret = rmap_set(rmap, iblk, clu);
+		if (ret)
+			return ret;
+		n++;
+	}
+
+	/* a block we know nothing about, the index is incomplete */
+	if (n + n_free < a_h - s)
+		return 0;
+
+	*out = n;
+	*ok = 1;
+
+	return 0;
+}
+
+int range_build_indexed(struct reloc_index **idx_p,
+		__u32 a_h, __u32 n_free_blocks,
+		struct rmap *rmap,
+		struct delta     *delta,
+		struct freemap   *freemap,
+		struct freemap  **rangemap_pp,
+		struct relocmap **relocmap_pp)
+{
+	int ret, ok = 0;
+	__u32 s = a_h - n_free_blocks;
+	__u32 n;
+
+	if (*idx_p != NULL) {
+		ret = reloc_index_lookup(*idx_p, s, a_h, rmap, delta, freemap,
+				0, &n, &ok);
+		if (ret)
+			return ret;
+	}
 
-		if (fext->iblk <= ridx) {
-			rmap[ridx] = fext->clu + (ridx - fext->iblk);
-			if(--n_to_fix == 0)
-				return;
+	if (!ok) {
+		reloc_index_free(*idx_p);
+		*idx_p = NULL;
+
+		ret = reloc_index_build(idx_p, s, a_h, rmap->len, delta);
+		if (ret)
+			return ret;
+
+		ret = reloc_index_lookup(*idx_p, s, a_h, rmap, delta, freemap,
+				1, &n, &ok);
+		if (ret)
+			return ret;
+		if (!ok)
+			return range_build(a_h, n_free_blocks, rmap, delta,
+					freemap, rangemap_pp, relocmap_pp);
+	}
+
+	return range_build_finish(s, a_h, n, n_free_blocks, rmap,
+			freemap, rangemap_pp, relocmap_pp);
+}
+
+static int range_fix_gaps(struct freemap *freemap, __u32 iblk_start, __u32 iblk_end,
+		    __u32 n_to_fix, struct rmap *rmap)
+{
+	__u32 ridx, end;
+	int i;
+	struct ploop_free_cluster_extent *fext;
+
+	/* only the free extents within the range can fill the gaps */
+	for (i = freemap_lookup(freemap, 0, iblk_start);
+			i < freemap->n_entries_used; i++) {
+		fext = &freemap->extents[i];
+		if (fext->iblk >= iblk_end)
+			break;
+
+		ridx = fext->iblk > iblk_start ? fext->iblk : iblk_start;
+		end = fext->iblk + fext->len < iblk_end ?
+			fext->iblk + fext->len : iblk_end;
+		for (; ridx < end; ridx++) {
+			if (rmap_get(rmap, ridx) != PLOOP_ZERO_INDEX)
+				continue;
+
+			if (rmap_set(rmap, ridx, fext->clu + (ridx - fext->iblk)))
+				return SYSEXIT_MALLOC;
+			if (--n_to_fix == 0)
+				return 0;
 		}
 	}
+
+	return 0;
 }
 
 struct relocmap *relocmap_alloc(int n)
@@ -635,25 +1005,18 @@ static int relocmap_add_extent(struct relocmap **relocmap_pp,
 			 __u32 clu, __u32 iblk, __u32 len, __u32 free)
 {
 	int i;
-	struct relocmap *relocmap = *relocmap_pp;
+	struct relocmap *relocmap;
 
 	if (!len)
 		return 0;
 
-	if (relocmap->n_entries_used == relocmap->n_entries_alloced) {
-		i = relocmap->n_entries_alloced * 2;
-
-		*relocmap_pp = realloc(*relocmap_pp, offsetof(struct relocmap,
-							    extents[i]));
-		if (!*relocmap_pp) {
-			ploop_err(errno, "Can't realloc relocmap");
-			return SYSEXIT_MALLOC;
-		}
-
-		relocmap = *relocmap_pp;
-		relocmap->n_entries_alloced = i;
+	relocmap = extmap_grow(*relocmap_pp, offsetof(struct relocmap, extents),
+			sizeof(struct ploop_reloc_cluster_extent));
+	if (relocmap == NULL) {
+		ploop_err(errno, "Can't realloc relocmap");
+		return SYSEXIT_MALLOC;
 	}
-
+	*relocmap_pp = relocmap;
 
 	i = relocmap->n_entries_used++;
 	relocmap->extents[i].clu = clu;
@@ -679,9 +1042,9 @@ static int range_split(struct freemap *rangemap, struct freemap *freemap,
 
 		while (rl > 0) {
 			/* find first free extent intersecting with us */
-			while (j < freemap->n_entries_used &&
-			       freemap->extents[j].iblk + freemap->extents[j].len <= ri)
-				j++;
+			if (j < freemap->n_entries_used &&
+			    freemap->extents[j].iblk + freemap->extents[j].len <= ri)
+				j = freemap_lookup(freemap, j + 1, ri);
 
 			if (j >= freemap->n_entries_used) {
 				ret = relocmap_add_extent(relocmap_pp, rc, ri, rl, 0);
@@ -720,6 +1083,52 @@ static int range_split(struct freemap *rangemap, struct freemap *freemap,
 	return 0;
 }
 
+/* Bring the index in line with the image after PLOOP_IOC_RELOCBLKS
+ * moved the blocks of @relocmap and truncated the image to @new_a_h.
+ */
+int reloc_index_update(struct reloc_index *idx, struct relocmap *relocmap,
+		__u32 new_a_h, struct delta *delta)
+{
+	int i, ret;
+	__u32 k, clu, iblk;
+
+	if (relocmap == NULL)
+		goto out;
+
+	delta->l2_cache = -1;
+	for (i = 0; i < relocmap->n_entries_used; i++) {
+		struct ploop_reloc_cluster_extent *ext = &relocmap->extents[i];
+
+		for (k = 0; k < ext->len; k++) {
+			iblk = ext->iblk + k;
+			if (iblk >= idx->start && iblk < idx->end &&
+			    rmap_get(idx->rmap, iblk) != PLOOP_ZERO_INDEX) {
+				ret = rmap_set(idx->rmap, iblk, PLOOP_ZERO_INDEX);
+				if (ret)
+					return ret;
+			}
+			if (ext->free)
+				continue;
+
+			clu = ext->clu + k;
+			ret = read_l2_entry(delta, clu, &iblk);
+			if (ret)
+				return ret;
+			if (iblk == 0 || iblk < idx->start || iblk >= idx->end)
+				continue;
+			ret = rmap_set(idx->rmap, iblk, clu);
+			if (ret)
+				return ret;
+		}
+	}
+
+out:
+	if (idx->end > new_a_h)
+		idx->end = new_a_h;
+
+	return 0;
+}
+
 int relocmap2relocblks(struct relocmap *relocmap, int lvl, __u32 a_h, __u32 n_scanned,
 			struct ploop_relocblks_ctl **relocblks_pp)
 {
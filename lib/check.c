@@ -27,11 +27,18 @@
 #include <sys/vfs.h>
 #include <linux/types.h>
 #include <string.h>
+#include <pthread.h>
 #include <linux/fs.h>
 #include <linux/fiemap.h>
+#include <linux/falloc.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_L2_SCAN_SIMD	1
+#endif
 
 #include "ploop.h"
-static int check_and_repair_sparse(const char *image, int fd, __u64 cluster, int flags);
+static int check_and_repair_sparse(const char *image, int fd, __u64 cluster,
+		int flags, struct alloc_journal *aj);
 
 enum {
 	ZEROFIX = 0,
@@ -186,6 +193,146 @@ static int check_one_slot(struct ploop_check_desc *d, __u32 clu, off_t isec,
 	return 0;
 }
 
+/* Bulk scan of index entries: bitwise OR and unsigned maximum of
+ * all of them. This is enough to tell if an index cluster has no
+ * misaligned (V1) and no beyond EOF entries.
+ */
+typedef void (*scan_l2_fn)(const __u32 *l2, int n, __u32 *or_p, __u32 *max_p);
+
+static void scan_l2_scalar(const __u32 *l2, int n, __u32 *or_p, __u32 *max_p)
+{
+	__u32 or = 0, max = 0;
+	int i;
+
+	for (i = 0; i < n; i++) {
+		or |= l2[i];
+		if (l2[i] > max)
+			max = l2[i];
+	}
+
+	*or_p = or;
+	*max_p = max;
+}
+
+#ifdef HAVE_L2_SCAN_SIMD
+__attribute__((target("sse4.1")))
+static void scan_l2_sse4(const __u32 *l2, int n, __u32 *or_p, __u32 *max_p)
+{
+	__m128i vor = _mm_setzero_si128();
+	__m128i vmax = _mm_setzero_si128();
+	__u32 t[4], or, max;
+	int i;
+
+	for (i = 0; i + 4 <= n; i += 4) {
+		__m128i v = _mm_loadu_si128((const __m128i *)(l2 + i));
+
+		vor = _mm_or_si128(vor, v);
+		vmax = _mm_max_epu32(vmax, v);
+	}
+	scan_l2_scalar(l2 + i, n - i, &or, &max);
+
+	_mm_storeu_si128((__m128i *)t, vor);
+	or |= t[0] | t[1] | t[2] | t[3];
+	_mm_storeu_si128((__m128i *)t, vmax);
+	for (i = 0; i < 4; i++)
+		if (t[i] > max)
+			max = t[i];
+
+	*or_p = or;
+	*max_p = max;
+}
+
+__attribute__((target("avx2")))
+static void scan_l2_avx2(const __u32 *l2, int n, __u32 *or_p, __u32 *max_p)
+{
+	__m256i vor = _mm256_setzero_si256();
+	__m256i vmax = _mm256_setzero_si256();
+	__u32 t[8], or, max;
+	int i;
+
+	for (i = 0; i + 8 <= n; i += 8) {
+		__m256i v = _mm256_loadu_si256((const __m256i *)(l2 + i));
+
+		vor = _mm256_or_si256(vor, v);
+		vmax = _mm256_max_epu32(vmax, v);
+	}
+	scan_l2_scalar(l2 + i, n - i, &or, &max);
+
+	_mm256_storeu_si256((__m256i *)t, vor);
+	for (i = 0; i < 8; i++)
+		or |= t[i];
+	_mm256_storeu_si256((__m256i *)t, vmax);
+	for (i = 0; i < 8; i++)
+		if (t[i] > max)
+			max = t[i];
+
+	*or_p = or;
+	*max_p = max;
+}
+#endif
+
+static scan_l2_fn get_scan_l2_fn(void)
+{
+#ifdef HAVE_L2_SCAN_SIMD
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2"))
+		return scan_l2_avx2;
+	if (__builtin_cpu_supports("sse4.1"))
+		return scan_l2_sse4;
+#endif
+	return scan_l2_scalar;
+}
+
+/* Check an index cluster at once. Returns 1 if it is clean except for
+ * possible duplicates, which are handed to check_one_slot(). Returns 0
+ * if it has to be checked slot by slot.
+ */
+static int check_l2_bulk(struct ploop_check_desc *d, scan_l2_fn scan,
+		const __u32 *l2, int n, __u32 l2_slot, __u32 blocksize,
+		int version, int *ret)
+{
+	__u32 cluster_log = ffs(blocksize) - 1;
+	__u64 cluster = S2B(blocksize);
+	__u32 or, max, iblk;
+	int j;
+
+	/* the whole cluster is within the block device */
+	if ((__u64)(l2_slot + n - 1) << cluster_log > d->bd_size)
+		return 0;
+
+	scan(l2, n, &or, &max);
+	if (version == PLOOP_FMT_V1) {
+		if (or & (blocksize - 1))
+			return 0;
+		max >>= cluster_log;
+	}
+	if ((off_t)max * cluster + cluster > d->size)
+		return 0;
+
+	if (d->check) {
+		for (j = 0; j < n; j++) {
+			if (l2[j] == 0)
+				continue;
+			iblk = (version == PLOOP_FMT_V1) ?
+				l2[j] >> cluster_log : l2[j];
+			if (!(d->bmap[iblk / 32] & (1U << (iblk % 32)))) {
+				d->bmap[iblk / 32] |= (1U << (iblk % 32));
+				continue;
+			}
+			*ret = check_one_slot(d, l2_slot + j,
+					ploop_ioff_to_sec(l2[j], blocksize, version),
+					blocksize, version);
+			if (*ret)
+				return 1;
+		}
+	}
+
+	if (max > *d->alloc_head)
+		*d->alloc_head = max;
+
+	return 1;
+}
+
 int ploop_check(char *img, int flags, int ro, int raw, int verbose, __u32 *blocksize_p)
 {
 	struct ploop_check_desc d;
@@ -212,11 +359,13 @@ int ploop_check(char *img, int flags, int ro, int raw, int verbose, __u32 *block
 	int fatality = 0;   /* fatal errors detected */
 	int clean = 1;	    /* image is clean */
 	__u64 cluster;
+	struct alloc_journal *aj = NULL;
 
 	int force = (flags & CHECK_FORCE);
 	int hard_force = (flags & CHECK_HARDFORCE);
 	int check = (flags & CHECK_DETAILED);
 	int version;
+	scan_l2_fn scan_l2 = get_scan_l2_fn();
 
 	fd = open(img, ro ? O_RDONLY : O_RDWR);
 	if (fd < 0) {
@@ -281,6 +430,22 @@ int ploop_check(char *img, int flags, int ro, int raw, int verbose, __u32 *block
 	bd_size = get_SizeInSectors(vh);
 	alloc_head = l1_slots - 1;
 
+	/* after a crash, the sparse scan can be limited to the blocks
+	 * allocated since the last checkpoint of the allocation journal
+	 */
+	if (vh->m_DiskInUse && !force && alloc_journal_read(img, &aj) == 0) {
+		if (aj->blocksize != vh->m_Sectors ||
+				(off_t)aj->alloc_head * cluster > stb.st_size) {
+			ploop_log(0, "Allocation journal does not match image %s",
+					img);
+			free(aj);
+			aj = NULL;
+		} else
+			ploop_log(0, "Using allocation journal gen=%u a_h=%u ranges=%u",
+					aj->generation, aj->alloc_head,
+					aj->nr_ranges);
+	}
+
 	if (!vh->m_DiskInUse && !force) {
 		if (verbose)
 			ploop_log(0, "Image is clean, check is skipped");
@@ -342,6 +507,14 @@ int ploop_check(char *img, int flags, int ro, int raw, int verbose, __u32 *block
 				goto done;
 		}
 
+		if (check_l2_bulk(&d, scan_l2, l2_ptr + skip, cluster/4 - skip,
+					l2_slot, vh->m_Sectors, version, &ret)) {
+			if (ret)
+				goto done;
+			l2_slot += cluster/4 - skip;
+			continue;
+		}
+
 		for (j = skip; j < cluster/4; j++, l2_slot++) {
 			if (l2_ptr[j] == 0)
 				continue;
@@ -359,6 +532,7 @@ int ploop_check(char *img, int flags, int ro, int raw, int verbose, __u32 *block
 	if (check) {
 		for (i = 0; i < bmap_size/4; i++) {
 			int k;
+			__u32 w;
 
 			if (bmap[i] == 0xFFFFFFFF)
 				continue;
@@ -366,10 +540,12 @@ int ploop_check(char *img, int flags, int ro, int raw, int verbose, __u32 *block
 			if (i * 32 >= alloc_head)
 				break;
 
-			for (k = 0; k < 32 && k < alloc_head - i * 32; k++) {
-				if (!(bmap[i] & (1 << k))) {
-					ploop_log(0, "Hole at block %u", i*32 + k);
-				}
+			/* walk over the clear bits only */
+			for (w = ~bmap[i]; w != 0; w &= w - 1) {
+				k = __builtin_ctz(w);
+				if (k >= alloc_head - i * 32)
+					break;
+				ploop_log(0, "Hole at block %u", i*32 + k);
 			}
 		}
 	}
@@ -434,23 +610,70 @@ int ploop_check(char *img, int flags, int ro, int raw, int verbose, __u32 *block
 		ret = fsync_safe(fd);
 done:
 	if (ret == 0)
-		ret = check_and_repair_sparse(img, fd, cluster, flags);
+		ret = check_and_repair_sparse(img, fd, cluster, flags, aj);
 
 	ret2 = close_safe(fd);
 	if (ret2 && !ret)
 		ret = ret2;
 
+	free(aj);
 	free(bmap);
 	free(buf);
 
 	return ret;
 }
 
-static int fill_hole(const char *image, int fd, off_t start, off_t end, int *log, int repair)
+#define FILL_HOLE_BUF_SIZE	0x100000
+
+static int write_zeroes(int fd, off_t start, off_t end)
 {
-	static char buf[0x100000];
+	char *buf;
 	off_t offset;
 
+	if (start >= end)
+		return 0;
+
+	/* not static: deltas can be checked in parallel */
+	buf = calloc(1, FILL_HOLE_BUF_SIZE);
+	if (buf == NULL) {
+		ploop_err(ENOMEM, "fill_hole: malloc");
+		return SYSEXIT_MALLOC;
+	}
+
+	for (offset = start; offset < end; offset += FILL_HOLE_BUF_SIZE) {
+		ssize_t n, len;
+
+		len = end - offset;
+		if (len > FILL_HOLE_BUF_SIZE)
+			len = FILL_HOLE_BUF_SIZE;
+
+		n = pwrite(fd, buf, len, offset);
+		if (n != len) {
+			if (n >= 0)
+				errno = EIO;
+			ploop_err(errno, "Failed to write");
+			free(buf);
+			return SYSEXIT_WRITE;
+		}
+	}
+	free(buf);
+
+	return 0;
+}
+
+/* Make [start, end) allocated without writing the whole range.
+ * Only the parts not aligned to cluster are written with zeroes;
+ * the aligned part of a hole is preallocated, the aligned part of
+ * an uninitialized extent is left as is. Both read as zeroes, and
+ * cluster aligned uninitialized extents are handled by the kernel.
+ * The caller is responsible for fsync.
+ */
+static int fill_hole(const char *image, int fd, off_t start, off_t end,
+		__u64 cluster, int unwritten, int *log, int repair)
+{
+	int ret;
+	off_t head_end, tail_start;
+
 	if (!*log) {
 		ploop_err(0, "%s: ploop image '%s' is sparse",
 				repair ? "Warning" : "Error", image);
@@ -460,67 +683,64 @@ static int fill_hole(const char *image, int fd, off_t start, off_t end, int *log
 		ploop_log(0, "Reallocating sparse blocks back");
 	}
 
-	ploop_log(1, "Filling hole at start=%lu len=%lu",
+	ploop_log(1, "Filling %s at start=%lu len=%lu",
+			unwritten ? "uninitialized extent" : "hole",
 			(long unsigned)start,
 			(long unsigned)(end - start));
 
-	bzero(buf, sizeof(buf));
-	for (offset = start; offset < end; offset += sizeof(buf)) {
-		ssize_t n, len;
+	head_end = (start + cluster - 1) / cluster * cluster;
+	if (head_end > end)
+		head_end = end;
+	tail_start = end / cluster * cluster;
+	if (tail_start < head_end)
+		tail_start = head_end;
 
-		len = end - offset;
-		if (len > sizeof(buf))
-			len = sizeof(buf);
+	ret = write_zeroes(fd, start, head_end);
+	if (ret)
+		return ret;
 
-		n = pwrite(fd, buf, len, offset);
-		if (n != len) {
-			if (n >= 0)
-				errno = EIO;
-			ploop_err(errno, "Failed to write");
+	if (!unwritten && head_end < tail_start &&
+			sys_fallocate(fd, FALLOC_FL_KEEP_SIZE, head_end,
+				tail_start - head_end)) {
+		if (errno != ENOTSUP) {
+			ploop_err(errno, "Failed to fallocate");
 			return SYSEXIT_WRITE;
 		}
+		ret = write_zeroes(fd, head_end, tail_start);
+		if (ret)
+			return ret;
 	}
 
-	return fsync_safe(fd);
+	return write_zeroes(fd, tail_start, end);
 }
 
-static int check_and_repair_sparse(const char *image, int fd, __u64 cluster, int flags)
+/* The scan is done without FIEMAP_FLAG_SYNC: delayed allocations are
+ * reported as extents, so holes are found correctly without forcing
+ * writeback of the whole delta. Uninitialized extents are not final
+ * until written back, so the range is rescanned synced before such an
+ * extent is repaired.
+ */
+static int check_sparse_range(const char *image, int fd, __u64 cluster,
+		__u64 start, __u64 end, int *log, int repair)
 {
 	int last;
 	int i, ret;
-	struct statfs sfs;
-	struct stat st;
 	__u64 prev_end;
+	__u32 sync = 0;
 	char buf[40960] = "";
 	struct fiemap *fiemap = (struct fiemap *)buf;
 	struct fiemap_extent *fm_ext = &fiemap->fm_extents[0];
-	int log = 0;
 	int count = (sizeof(buf) - sizeof(*fiemap)) /
 		    sizeof(struct fiemap_extent);
-	int repair = flags & CHECK_REPAIR_SPARSE;
-
-	ret = fstatfs(fd, &sfs);
-	if (ret < 0) {
-		ploop_err(errno, "Unable to statfs delta file %s", image);
-		return SYSEXIT_FSTAT;
-	}
 
-	if (sfs.f_type != EXT4_SUPER_MAGIC)
-		return 0;
-
-	ret = fstat(fd, &st);
-	if (ret < 0) {
-		ploop_err(errno, "Unable to stat delta file %s", image);
-		return SYSEXIT_FSTAT;
-	}
-
-	prev_end = 0;
+again:
+	prev_end = start;
 	last = 0;
 
-	while (!last && prev_end < st.st_size) {
+	while (!last && prev_end < end) {
 		fiemap->fm_start	= prev_end;
-		fiemap->fm_length	= st.st_size;
-		fiemap->fm_flags	= FIEMAP_FLAG_SYNC;
+		fiemap->fm_length	= end - prev_end;
+		fiemap->fm_flags	= sync;
 		fiemap->fm_extent_count = count;
 
 		ret = ioctl_device(fd, FS_IOC_FIEMAP, (unsigned long) fiemap);
@@ -531,68 +751,304 @@ static int check_and_repair_sparse(const char *image, int fd, __u64 cluster, int
 			break;
 
 		for (i = 0; i < fiemap->fm_mapped_extents; i++) {
+			__u64 ext_end = fm_ext[i].fe_logical + fm_ext[i].fe_length;
+
 			if (fm_ext[i].fe_flags & FIEMAP_EXTENT_LAST)
 				last = 1;
 			if ((fm_ext[i].fe_flags & FIEMAP_EXTENT_UNWRITTEN) &&
 			    (fm_ext[i].fe_logical % cluster ||
 					fm_ext[i].fe_length % cluster)) {
+				if (!sync) {
+					sync = FIEMAP_FLAG_SYNC;
+					goto again;
+				}
 				ploop_err(0, "Delta file %s contains uninitialized blocks"
 						" (offset=%llu len=%llu)"
 						" which are not aligned to cluster size",
 						image, fm_ext[i].fe_logical, fm_ext[i].fe_length);
 
 				if (fill_hole(image, fd, fm_ext[i].fe_logical,
-						fm_ext[i].fe_logical + fm_ext[i].fe_length, &log, repair))
+						ext_end, cluster, 1, log, repair))
 					return SYSEXIT_PLOOPFMT;
 			}
 
 			if (fm_ext[i].fe_flags & ~(FIEMAP_EXTENT_LAST |
-						   FIEMAP_EXTENT_UNWRITTEN))
+						   FIEMAP_EXTENT_UNWRITTEN |
+						   FIEMAP_EXTENT_DELALLOC |
+						   FIEMAP_EXTENT_UNKNOWN))
 				ploop_log(1, "Warning: extent with unexpected flags 0x%x",
 									fm_ext[i].fe_flags);
-			if (prev_end != fm_ext[i].fe_logical &&
-					fill_hole(image, fd, prev_end, fm_ext[i].fe_logical, &log, repair))
+			/* the first extent may start before the range */
+			if (prev_end < fm_ext[i].fe_logical &&
+					fill_hole(image, fd, prev_end,
+						fm_ext[i].fe_logical < end ?
+						fm_ext[i].fe_logical : end,
+						cluster, 0, log, repair))
 				return SYSEXIT_PLOOPFMT;
 
-			prev_end = fm_ext[i].fe_logical + fm_ext[i].fe_length;
+			if (ext_end > prev_end)
+				prev_end = ext_end;
 		}
 	}
 
-	if (prev_end < st.st_size &&
-			fill_hole(image, fd, prev_end, st.st_size, &log, repair))
+	if (prev_end < end &&
+			fill_hole(image, fd, prev_end, end, cluster, 0, log, repair))
 		return SYSEXIT_PLOOPFMT;
 
 	return 0;
 }
 
-int check_deltas(struct ploop_disk_images_data *di, char **images,
-		struct ploop_mount_param *param, int raw, __u32 *blocksize)
+static int check_and_repair_sparse(const char *image, int fd, __u64 cluster,
+		int flags, struct alloc_journal *aj)
 {
-	int i;
-	int ret = 0;
+	int i, ret;
+	struct statfs sfs;
+	struct stat st;
+	int log = 0;
+	int repair = flags & CHECK_REPAIR_SPARSE;
+
+	ret = fstatfs(fd, &sfs);
+	if (ret < 0) {
+		ploop_err(errno, "Unable to statfs delta file %s", image);
+		return SYSEXIT_FSTAT;
+	}
 
-	for (i = 0; images[i] != NULL; i++) {
-		int ro;
-		int flags = CHECK_DETAILED | (di ? (CHECK_DROPINUSE | CHECK_REPAIR_SPARSE) : 0);
-		int raw_delta = (raw && i == 0);
-		__u32 cur_blocksize = raw_delta ? *blocksize : 0;
+	if (sfs.f_type != EXT4_SUPER_MAGIC)
+		return 0;
 
-		ro = (images[i+1] != NULL || param->ro) ? 1 : 0;
-		ret = ploop_check(images[i], flags, ro, raw_delta, 0, &cur_blocksize);
-		if (ret) {
+	ret = fstat(fd, &st);
+	if (ret < 0) {
+		ploop_err(errno, "Unable to stat delta file %s", image);
+		return SYSEXIT_FSTAT;
+	}
+
+	if (aj == NULL) {
+		ret = check_sparse_range(image, fd, cluster, 0, st.st_size,
+				&log, repair);
+		goto out;
+	}
+
+	/* only the journaled ranges and the tail past the checkpoint */
+	for (i = 0; i < aj->nr_ranges; i++) {
+		__u64 start = aj->ranges[i].iblk * cluster;
+		__u64 end = start + aj->ranges[i].len * cluster;
+
+		if (start >= st.st_size)
+			continue;
+		if (end > st.st_size)
+			end = st.st_size;
+		ret = check_sparse_range(image, fd, cluster, start, end,
+				&log, repair);
+		if (ret)
+			goto out;
+	}
+
+	ret = check_sparse_range(image, fd, cluster, aj->alloc_head * cluster,
+			st.st_size, &log, repair);
+out:
+	/* one fsync for all the repaired ranges */
+	if (log) {
+		int ret2 = fsync_safe(fd);
+
+		if (ret2 && !ret)
+			ret = ret2;
+	}
+
+	return ret;
+}
+
+#define MAX_CHECK_THREADS	8
+
+struct check_result {
+	int done;
+	int ret;
+	__u32 blocksize;
+};
+
+struct delta_check_pool {
+	char **images;
+	int nimages;
+	int flags;
+	int ro;			/* mount is read-only */
+	int raw;
+	__u32 raw_blocksize;
+	int next;		/* next image to pick up */
+	int failed;		/* stop picking up new images */
+	int nthreads;
+	pthread_t *threads;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	struct check_result *res;
+};
+
+static void *check_delta_worker(void *data)
+{
+	struct delta_check_pool *pool = data;
+	struct check_result *res;
+	int i, ro, raw_delta, ret;
+	__u32 blocksize;
+
+	for (;;) {
+		pthread_mutex_lock(&pool->lock);
+		if (pool->failed || pool->next == pool->nimages) {
+			pthread_mutex_unlock(&pool->lock);
+			break;
+		}
+		i = pool->next++;
+		pthread_mutex_unlock(&pool->lock);
+
+		raw_delta = (pool->raw && i == 0);
+		blocksize = raw_delta ? pool->raw_blocksize : 0;
+		ro = (i != pool->nimages - 1 || pool->ro);
+		ret = ploop_check(pool->images[i], pool->flags, ro, raw_delta,
+				0, &blocksize);
+		if (ret)
 			ploop_err(0, "%s (%s): irrecoverable errors",
-					images[i], ro ? "ro" : "rw");
+					pool->images[i], ro ? "ro" : "rw");
+
+		pthread_mutex_lock(&pool->lock);
+		res = &pool->res[i];
+		res->ret = ret;
+		res->blocksize = blocksize;
+		res->done = 1;
+		if (ret)
+			pool->failed = 1;
+		pthread_cond_broadcast(&pool->cond);
+		pthread_mutex_unlock(&pool->lock);
+	}
+
+	return NULL;
+}
+
+static void free_check_pool(struct delta_check_pool *pool)
+{
+	pthread_mutex_destroy(&pool->lock);
+	pthread_cond_destroy(&pool->cond);
+	free(pool->threads);
+	free(pool->res);
+	free(pool);
+}
+
+/* Start checking of all deltas in the background. The results are
+ * collected by check_deltas_wait() and check_deltas_finish().
+ */
+int check_deltas_start(struct ploop_disk_images_data *di, char **images,
+		struct ploop_mount_param *param, int raw, __u32 blocksize,
+		struct delta_check_pool **out)
+{
+	struct delta_check_pool *pool;
+	long ncpu;
+	int i, ret;
+
+	pool = calloc(1, sizeof(*pool));
+	if (pool == NULL)
+		goto err_nomem;
+
+	pool->images = images;
+	pool->nimages = get_list_size(images);
+	pool->flags = CHECK_DETAILED |
+		(di ? (CHECK_DROPINUSE | CHECK_REPAIR_SPARSE) : 0);
+	pool->ro = param->ro;
+	pool->raw = raw;
+	pool->raw_blocksize = blocksize;
+	pthread_mutex_init(&pool->lock, NULL);
+	pthread_cond_init(&pool->cond, NULL);
+
+	ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+	pool->nthreads = pool->nimages;
+	if (ncpu > 0 && pool->nthreads > ncpu)
+		pool->nthreads = ncpu;
+	if (pool->nthreads > MAX_CHECK_THREADS)
+		pool->nthreads = MAX_CHECK_THREADS;
+
+	pool->res = calloc(pool->nimages, sizeof(struct check_result));
+	pool->threads = calloc(pool->nthreads, sizeof(pthread_t));
+	if (pool->res == NULL || pool->threads == NULL) {
+		free_check_pool(pool);
+		goto err_nomem;
+	}
+
+	for (i = 0; i < pool->nthreads; i++) {
+		ret = pthread_create(&pool->threads[i], NULL,
+				check_delta_worker, pool);
+		if (ret) {
+			ploop_err(ret, "Can't create thread");
+			break;
+		}
+	}
+	if (i == 0 && pool->nimages != 0) {
+		free_check_pool(pool);
+		return SYSEXIT_SYS;
+	}
+	/* some workers are running, they'll process the whole list */
+	pool->nthreads = i;
+
+	*out = pool;
+	return 0;
+
+err_nomem:
+	ploop_err(ENOMEM, "check_deltas_start");
+	return SYSEXIT_MALLOC;
+}
+
+/* Wait for the check of the image @idx to complete */
+int check_deltas_wait(struct delta_check_pool *pool, int idx, __u32 *blocksize)
+{
+	int ret;
+
+	pthread_mutex_lock(&pool->lock);
+	while (!pool->res[idx].done && !(pool->failed && idx >= pool->next))
+		pthread_cond_wait(&pool->cond, &pool->lock);
+	ret = pool->res[idx].done ? pool->res[idx].ret : SYSEXIT_ABORT;
+	*blocksize = pool->res[idx].blocksize;
+	pthread_mutex_unlock(&pool->lock);
+
+	return ret;
+}
+
+/* Wait for all the checks, verify the blocksize consistency and
+ * release the pool. The first error in the chain order is returned.
+ */
+int check_deltas_finish(struct delta_check_pool *pool, __u32 *blocksize)
+{
+	int i, ret = 0;
+
+	for (i = 0; i < pool->nthreads; i++)
+		pthread_join(pool->threads[i], NULL);
+
+	for (i = 0; i < pool->nimages; i++) {
+		struct check_result *res = &pool->res[i];
+
+		if (!res->done)
+			continue;
+		if (res->ret) {
+			ret = res->ret;
 			break;
 		}
 		if (*blocksize == 0)
-			*blocksize = cur_blocksize;
-		if (cur_blocksize != *blocksize) {
+			*blocksize = res->blocksize;
+		if (res->blocksize != *blocksize) {
 			ploop_err(0, "Incorrect blocksize %s bs=%d [current bs=%d]",
-					images[i], *blocksize, cur_blocksize);
+					pool->images[i], *blocksize, res->blocksize);
 			ret = SYSEXIT_PARAM;
 			break;
 		}
 	}
 
+	free_check_pool(pool);
+
 	return ret;
 }
+
+int check_deltas(struct ploop_disk_images_data *di, char **images,
+		struct ploop_mount_param *param, int raw, __u32 *blocksize)
+{
+	struct delta_check_pool *pool;
+	int ret;
+
+	ret = check_deltas_start(di, images, param, raw, *blocksize, &pool);
+	if (ret)
+		return ret;
+
+	return check_deltas_finish(pool, blocksize);
+}
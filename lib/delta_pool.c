@@ -0,0 +1,235 @@
+/*
+ *  Copyright (C) 2008-2012, Parallels, Inc. All rights reserved.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/* Pool of empty deltas.
+ *
+ * A snapshot has to create, fill and fsync its new top delta while the
+ * descriptor is locked (and, online, while the file system is frozen
+ * for the snapshot). A pool keeps up to DELTA_POOL_MAX empty deltas
+ * made in advance next to the base image, as BASE.pool.N. A snapshot
+ * takes one of them by a link to the new delta name (snapshots run under
+ * the descriptor lock, one at a time) and checks the delta it has got.
+ *
+ * Pool deltas are only used when their header is exactly the one a new
+ * delta would get, so the ones left from before a resize (or a change
+ * of the format) are never used; ploop_refill_delta_pool() replaces
+ * them and the resize drops them right away.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <limits.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <linux/types.h>
+
+#include "ploop.h"
+
+static void get_pool_fname(const char *base, int n, char *out, int size)
+{
+	snprintf(out, size, "%s.pool.%d", base, n);
+}
+
+/* Is the pool delta open at @fd what create_empty_delta() would make? */
+static int is_pool_delta_valid(int fd, __u32 blocksize, off_t bdsize,
+		int version)
+{
+	struct ploop_pvd_header vh, exp = {};
+	struct stat st;
+
+	if (version == PLOOP_FMT_UNDEFINED)
+		return 0;
+
+	generate_pvd_header(&exp, bdsize, blocksize, version);
+	exp.m_Flags = CIF_Empty;
+
+	if (pread(fd, &vh, sizeof(vh), 0) != sizeof(vh) ||
+			memcmp(&vh, &exp, sizeof(vh)))
+		return 0;
+
+	if (fstat(fd, &st) || st.st_size != S2B(exp.m_FirstBlockOffset))
+		return 0;
+
+	return 1;
+}
+
+/* Move a matching pool delta to @path. Returns the delta opened as
+ * create_empty_delta() does, or -1 if the pool has none.
+ */
+int delta_pool_claim(const char *base, const char *path, __u32 blocksize,
+		off_t bdsize, int version)
+{
+	char fname[PATH_MAX];
+	int i, fd, valid;
+
+	for (i = 0; i < DELTA_POOL_MAX; i++) {
+		get_pool_fname(base, i, fname, sizeof(fname));
+		if (link(fname, path)) {
+			if (errno == ENOENT)
+				continue;
+			ploop_err(errno, "Can't link %s to %s", fname, path);
+			return -1;
+		}
+
+		/* a filler may have renamed another delta into the slot,
+		 * so it is what we have linked that is checked
+		 */
+		fd = open(path, O_RDONLY | O_CLOEXEC);
+		if (fd == -1) {
+			ploop_err(errno, "Can't open %s", path);
+			unlink(path);
+			return -1;
+		}
+		valid = is_pool_delta_valid(fd, blocksize, bdsize, version);
+		close(fd);
+		if (!valid) {
+			unlink(path);
+			continue;
+		}
+
+		if (unlink(fname) && errno != ENOENT) {
+			ploop_err(errno, "Can't unlink %s", fname);
+			unlink(path);
+			return -1;
+		}
+
+		fd = open(path, O_RDWR | O_DIRECT);
+		if (fd == -1) {
+			ploop_err(errno, "Can't open %s", path);
+			unlink(path);
+			return -1;
+		}
+
+		ploop_log(0, "Using pooled delta %s for %s", fname, path);
+		return fd;
+	}
+
+	return -1;
+}
+
+/* Make the first @count pool slots hold valid deltas, remove the rest.
+ * The lock file stays once created: a filler that opened it just before
+ * an unlink would lock an orphan and race with the next one on the tmp
+ * delta.
+ */
+int delta_pool_fill(const char *base, int count, __u32 blocksize,
+		off_t bdsize, int version)
+{
+	char fname[PATH_MAX];
+	char tmp[PATH_MAX];
+	int i, fd, lfd, valid, ret = 0;
+
+	/* one filler at a time, the others have nothing to do */
+	snprintf(tmp, sizeof(tmp), "%s.pool.lck", base);
+	lfd = open(tmp, O_RDWR | O_CLOEXEC | (count ? O_CREAT : 0), 0600);
+	if (lfd == -1) {
+		/* no lock file, there never was a pool */
+		if (errno == ENOENT && count == 0)
+			return 0;
+		ploop_err(errno, "Can't open %s", tmp);
+		return SYSEXIT_OPEN;
+	}
+	/* a drop must not be skipped: a filler running now may be making
+	 * deltas of the size the image had before a resize
+	 */
+	if (flock(lfd, count ? LOCK_EX | LOCK_NB : LOCK_EX)) {
+		close(lfd);
+		return 0;
+	}
+
+	if (version == PLOOP_FMT_UNDEFINED)
+		count = 0;
+
+	snprintf(tmp, sizeof(tmp), "%s.pool.tmp", base);
+	for (i = 0; i < DELTA_POOL_MAX; i++) {
+		get_pool_fname(base, i, fname, sizeof(fname));
+		fd = open(fname, O_RDONLY | O_CLOEXEC);
+		if (fd != -1) {
+			valid = is_pool_delta_valid(fd, blocksize, bdsize,
+					version);
+			close(fd);
+			if (valid && i < count)
+				continue;
+			if (unlink(fname) && errno != ENOENT)
+				ploop_err(errno, "Can't unlink %s", fname);
+		}
+		if (i >= count)
+			continue;
+
+		/* never let a half made delta into the pool */
+		unlink(tmp);
+		fd = create_empty_delta(tmp, blocksize, bdsize, version);
+		if (fd == -1) {
+			ret = SYSEXIT_CREAT;
+			break;
+		}
+		close(fd);
+		if (rename(tmp, fname)) {
+			ploop_err(errno, "Can't rename %s to %s", tmp, fname);
+			unlink(tmp);
+			ret = SYSEXIT_RENAME;
+			break;
+		}
+	}
+
+	close(lfd);
+
+	return ret;
+}
+
+void delta_pool_drop(const char *base)
+{
+	delta_pool_fill(base, 0, 0, 0, PLOOP_FMT_UNDEFINED);
+}
+
+int ploop_refill_delta_pool(struct ploop_disk_images_data *di, int count)
+{
+	char base[PATH_MAX];
+	off_t size;
+	__u32 blocksize;
+	int version;
+	int ret;
+
+	if (di->nimages == 0) {
+		ploop_err(0, "No images");
+		return SYSEXIT_PARAM;
+	}
+	if (count < 0 || count > DELTA_POOL_MAX) {
+		ploop_err(0, "Incorrect pool size %d, the maximum is %d",
+				count, DELTA_POOL_MAX);
+		return SYSEXIT_PARAM;
+	}
+
+	if (ploop_lock_di(di))
+		return SYSEXIT_LOCK;
+
+	ret = get_image_param(di, di->top_guid, &size, &blocksize, &version);
+	snprintf(base, sizeof(base), "%s", di->images[0]->file);
+
+	ploop_unlock_di(di);
+
+	if (ret)
+		return ret;
+
+	/* the deltas are made without the lock, they are not in use yet */
+	return delta_pool_fill(base, count, blocksize, size, version);
+}
@@ -24,9 +24,20 @@
 #include <malloc.h>
 #include <string.h>
 #include <sys/stat.h>
+#include <sys/ioctl.h>
 
 #include "ploop.h"
 
+#ifndef FICLONERANGE
+struct file_clone_range {
+	__s64 src_fd;
+	__u64 src_offset;
+	__u64 src_length;
+	__u64 dest_offset;
+};
+#define FICLONERANGE	_IOW(0x94, 13, struct file_clone_range)
+#endif
+
 void init_delta_array(struct delta_array * p)
 {
 	p->delta_max = 0;
@@ -89,6 +100,37 @@ static int local_delta_fsync(int fd)
 {
 	return fsync(fd);
 }
+/* Share the blocks if the filesystem supports reflinks, otherwise
+ * let the kernel copy the data. Returns 0 only if all @count bytes
+ * were transferred.
+ */
+static int local_delta_copy_range(int fd_in, off_t off_in, int fd_out,
+		off_t off_out, size_t count)
+{
+	struct file_clone_range fcr = {
+		.src_fd = fd_in,
+		.src_offset = off_in,
+		.src_length = count,
+		.dest_offset = off_out,
+	};
+	ssize_t n;
+
+	if (ioctl(fd_out, FICLONERANGE, &fcr) == 0)
+		return 0;
+
+	while (count) {
+		n = sys_copy_file_range(fd_in, &off_in, fd_out, &off_out,
+				count, 0);
+		if (n <= 0) {
+			if (n == 0)
+				errno = EIO;
+			return -1;
+		}
+		count -= n;
+	}
+
+	return 0;
+}
 static struct delta_fops local_delta_fops = {
 	.open = local_delta_open,
 	.close = local_delta_close,
@@ -96,6 +138,7 @@ static struct delta_fops local_delta_fops = {
 	.pwrite = local_delta_pwrite,
 	.fstat = local_delta_fstat,
 	.fsync = local_delta_fsync,
+	.copy_range = local_delta_copy_range,
 };
 
 void close_delta(struct delta *delta)
@@ -113,6 +156,26 @@ void close_delta(struct delta *delta)
 	errno = err;
 }
 
+/* Transfer a data block between two deltas. Reflink and in-kernel copy
+ * are tried first, the buffered copy through @buf (of at least @size
+ * bytes) is the fallback. CB_BUFFERED forces the buffered copy.
+ */
+int copy_delta_block(struct delta *src, off_t src_off, struct delta *dst,
+		off_t dst_off, unsigned int size, void *buf, int flags)
+{
+	if (!(flags & CB_BUFFERED) &&
+	    src->fops == dst->fops && src->fops->copy_range != NULL &&
+	    src->fops->copy_range(src->fd, src_off, dst->fd, dst_off, size) == 0)
+		return 0;
+
+	if (PREAD(src, buf, size, src_off))
+		return SYSEXIT_READ;
+	if (PWRITE(dst, buf, size, dst_off))
+		return SYSEXIT_WRITE;
+
+	return 0;
+}
+
 int open_delta_simple(struct delta * delta, const char * path, int rw, int od_flags)
 {
 	delta->fops = &local_delta_fops;
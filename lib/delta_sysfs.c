@@ -282,16 +282,9 @@ close_dir:
 int ploop_get_dev_by_delta(const char *component_name, const char *delta,
 		char **out[])
 {
-	char fname[PATH_MAX];
 	char delta_r[PATH_MAX];
-	char image[PATH_MAX];
-	char dev[64];
-	DIR *dp;
-	struct dirent *de;
-	int ret = -1;
-	char cookie[PLOOP_COOKIE_SIZE];
 	int lckfd;
-	int nelem = 1;
+	int ret;
 
 	*out = NULL;
 
@@ -304,85 +297,11 @@ int ploop_get_dev_by_delta(const char *component_name, const char *delta,
 	if (lckfd == -1)
 		return -1;
 
-	snprintf(fname, sizeof(fname) - 1, "/sys/block/");
-	dp = opendir(fname);
-	if (dp == NULL) {
-		ploop_err(errno, "Can't opendir %s", fname);
-		goto err;
-	}
+	ret = devreg_get_dev(component_name, delta_r, out);
 
-	while ((de = readdir(dp)) != NULL) {
-		int err;
-		char **t;
-
-		if (strncmp("ploop", de->d_name, 5))
-			continue;
+	devreg_unlock(lckfd);
 
-		snprintf(fname, sizeof(fname), "/sys/block/%s/pdelta/0/image",
-				de->d_name);
-		err = read_line_quiet(fname, image, sizeof(image));
-		if (err) {
-			if (err == ENOENT || err == ENODEV)
-				continue;
-
-			ploop_err(err, "Can't open or read %s", fname);
-			goto err;
-		}
-
-		if (strcmp(image, delta_r))
-			continue;
-
-		snprintf(fname, sizeof(fname), "/sys/block/%s/pstate/cookie",
-				de->d_name);
-		err = read_line_quiet(fname, cookie, sizeof(cookie));
-		if (err) {
-			if (err == ENOENT || err == ENODEV)
-				/* This is not an error, but a race between
-				 * mount and umount: device is being removed
-				 */
-				continue;
-
-			ploop_err(err, "Can't open or read %s", fname);
-			if ((errno == ENOENT) && component_name)
-				/* Using component_name on old kernel is bad */
-				ploop_err(0, "ERROR: OpenVZ kernel with ploop cookie support "
-						"(i.e. 042stab061.1 or greater) is required");
-			goto err;
-		}
-
-		if (component_name && strncmp(component_name, cookie, sizeof(cookie)))
-			continue;
-
-		snprintf(dev, sizeof(dev), "/dev/%s", de->d_name);
-		t = realloc(*out, (nelem+1) * sizeof(char *));
-		if (t == NULL) {
-			ploop_err(ENOMEM, "Memory allocation failed");
-			goto err;
-		}
-		*out = t;
-		if ((t[nelem-1] = strdup(dev)) == NULL) {
-			ploop_err(ENOMEM, "Memory allocation failed");
-			goto err;
-		}
-		t[nelem++] = NULL;
-		if (component_name)
-			break;
-
-	}
-	ret = 0;
-
-err:
-	if (dp)
-		closedir(dp);
-	close(lckfd);
-
-	if (ret) {
-		ploop_free_array(*out);
-		*out = NULL;
-		return ret;
-	}
-
-	return (nelem == 1);
+	return ret;
 }
 
 void ploop_free_array(char *array[])
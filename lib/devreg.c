@@ -0,0 +1,610 @@
+/*
+ *  Copyright (C) 2008-2012, Parallels, Inc. All rights reserved.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/* Device registry.
+ *
+ * Finding the device an image is mounted on used to mean reading the base
+ * delta and cookie of every ploop device from sysfs. Instead, the running
+ * devices are kept in an index file, which is updated by mount (after
+ * PLOOP_IOC_START) and umount (after PLOOP_IOC_CLEAR), and cached in
+ * memory in a hash by image path. The cache is reloaded only when the
+ * file changes, and a found device is checked against its sysfs
+ * attributes, so a lookup costs a stat() and two reads.
+ *
+ * The index is rebuilt by a full /sys/block scan if it is missing, was
+ * written before the last boot, or turned out to be stale. A device that
+ * is not in the index is only reported missing after checking that the
+ * set of started devices in /sys/block is the one in the index, which
+ * takes a stat() per device instead of reading its attributes; so the
+ * devices set up bypassing the library (an older library, raw ioctls)
+ * are seen too. Tools doing that may call ploop_devreg_invalidate() to
+ * have the index rebuilt right away.
+ *
+ * The index and the cache are only used with the global lock taken. The
+ * set is checked once per lock session (see devreg_unlock()), so a batch
+ * of lookups pays for one check, unless the index changes in between.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <unistd.h>
+#include <limits.h>
+#include <string.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <linux/types.h>
+
+#include "ploop.h"
+
+#define DEVREG_FILE		PLOOP_LOCK_DIR "/devices"
+#define DEVREG_HASH_SIZE	1024
+#define BOOT_ID_FILE		"/proc/sys/kernel/random/boot_id"
+
+struct devreg_entry {
+	char name[64];			/* ploopN */
+	char cookie[PLOOP_COOKIE_SIZE];
+	char *image;
+	int next;			/* hash chain, -1 is the end */
+};
+
+static struct {
+	struct devreg_entry *e;
+	int n;
+	int hash[DEVREG_HASH_SIZE];
+	int valid;
+	/* the started devices are the indexed ones, for this lock session */
+	int set_ok;
+	/* the index file the cache was read from */
+	struct stat st;
+} reg;
+
+static unsigned int devreg_hash(const char *image)
+{
+	unsigned int h = 2166136261u;
+
+	for (; *image != '\0'; image++)
+		h = (h ^ (unsigned char)*image) * 16777619u;
+
+	return h % DEVREG_HASH_SIZE;
+}
+
+static void devreg_rehash(void)
+{
+	int i;
+	unsigned int h;
+
+	memset(reg.hash, 0xff, sizeof(reg.hash));
+	for (i = 0; i < reg.n; i++) {
+		h = devreg_hash(reg.e[i].image);
+		reg.e[i].next = reg.hash[h];
+		reg.hash[h] = i;
+	}
+}
+
+static void devreg_clear(void)
+{
+	int i;
+
+	for (i = 0; i < reg.n; i++)
+		free(reg.e[i].image);
+	free(reg.e);
+	reg.e = NULL;
+	reg.n = 0;
+	reg.valid = 0;
+	reg.set_ok = 0;
+}
+
+static int devreg_append(const char *name, const char *cookie,
+		const char *image)
+{
+	struct devreg_entry *e;
+
+	e = realloc(reg.e, (reg.n + 1) * sizeof(struct devreg_entry));
+	if (e == NULL)
+		goto err;
+	reg.e = e;
+	e = &reg.e[reg.n];
+
+	e->image = strdup(image);
+	if (e->image == NULL)
+		goto err;
+	snprintf(e->name, sizeof(e->name), "%s", name);
+	snprintf(e->cookie, sizeof(e->cookie), "%s", cookie);
+	reg.n++;
+
+	return 0;
+
+err:
+	ploop_err(ENOMEM, "Memory allocation failed");
+	return -1;
+}
+
+static void get_boot_id(char *out, int len)
+{
+	if (read_line_quiet(BOOT_ID_FILE, out, len))
+		out[0] = '\0';
+}
+
+static int same_file(struct stat *a, struct stat *b)
+{
+	return a->st_ino == b->st_ino && a->st_dev == b->st_dev &&
+		a->st_size == b->st_size &&
+		a->st_mtim.tv_sec == b->st_mtim.tv_sec &&
+		a->st_mtim.tv_nsec == b->st_mtim.tv_nsec;
+}
+
+/* Make the cache match the index file.
+ * Return: 0 ok, 1 there is no valid index
+ */
+static int devreg_load(void)
+{
+	FILE *fp;
+	struct stat st;
+	char buf[PATH_MAX + 256];
+	char boot_id[64], id[64];
+	char *name, *cookie, *image, *p;
+	int ret = 1;
+
+	if (stat(DEVREG_FILE, &st)) {
+		if (errno != ENOENT)
+			ploop_err(errno, "Can't stat " DEVREG_FILE);
+		devreg_clear();
+		return 1;
+	}
+	if (reg.valid && same_file(&st, &reg.st))
+		return 0;
+
+	devreg_clear();
+	fp = fopen(DEVREG_FILE, "r");
+	if (fp == NULL) {
+		ploop_err(errno, "Can't open " DEVREG_FILE);
+		return 1;
+	}
+	if (fstat(fileno(fp), &st)) {
+		ploop_err(errno, "Can't stat " DEVREG_FILE);
+		goto err;
+	}
+
+	get_boot_id(boot_id, sizeof(boot_id));
+	if (fgets(buf, sizeof(buf), fp) == NULL ||
+			sscanf(buf, "boot_id %63s", id) != 1 ||
+			strcmp(id, boot_id)) {
+		ploop_log(1, "Device index is out of date");
+		goto err;
+	}
+
+	/* name <TAB> cookie <TAB> image */
+	while (fgets(buf, sizeof(buf), fp) != NULL) {
+		if ((p = strchr(buf, '\n')) == NULL)
+			goto corrupted;
+		*p = '\0';
+		name = buf;
+		if ((cookie = strchr(name, '\t')) == NULL)
+			goto corrupted;
+		*cookie++ = '\0';
+		if ((image = strchr(cookie, '\t')) == NULL)
+			goto corrupted;
+		*image++ = '\0';
+
+		if (devreg_append(name, cookie, image))
+			goto err;
+	}
+
+	devreg_rehash();
+	reg.st = st;
+	reg.valid = 1;
+	ret = 0;
+	goto err;
+
+corrupted:
+	ploop_err(0, "Corrupted device index " DEVREG_FILE);
+err:
+	fclose(fp);
+	if (ret)
+		devreg_clear();
+
+	return ret;
+}
+
+static void devreg_drop(void)
+{
+	if (unlink(DEVREG_FILE) && errno != ENOENT)
+		ploop_err(errno, "Can't remove " DEVREG_FILE);
+	devreg_clear();
+}
+
+static int devreg_save(void)
+{
+	FILE *fp;
+	char boot_id[64];
+	const char *tmp = DEVREG_FILE ".tmp";
+	int i;
+
+	for (i = 0; i < reg.n; i++)
+		if (strchr(reg.e[i].image, '\t') || strchr(reg.e[i].cookie, '\t')) {
+			ploop_log(1, "Can't index %s", reg.e[i].image);
+			goto err;
+		}
+
+	if (access(PLOOP_LOCK_DIR, F_OK) &&
+			mkdir(PLOOP_LOCK_DIR, 0700) && errno != EEXIST) {
+		ploop_err(errno, "Failed to create " PLOOP_LOCK_DIR);
+		goto err;
+	}
+
+	fp = fopen(tmp, "w");
+	if (fp == NULL) {
+		ploop_err(errno, "Can't create %s", tmp);
+		goto err;
+	}
+
+	get_boot_id(boot_id, sizeof(boot_id));
+	fprintf(fp, "boot_id %s\n", boot_id);
+	for (i = 0; i < reg.n; i++)
+		fprintf(fp, "%s\t%s\t%s\n", reg.e[i].name, reg.e[i].cookie,
+				reg.e[i].image);
+
+	if (fclose(fp)) {
+		ploop_err(errno, "Can't write %s", tmp);
+		unlink(tmp);
+		goto err;
+	}
+	if (rename(tmp, DEVREG_FILE)) {
+		ploop_err(errno, "Can't rename %s to " DEVREG_FILE, tmp);
+		unlink(tmp);
+		goto err;
+	}
+	if (stat(DEVREG_FILE, &reg.st)) {
+		ploop_err(errno, "Can't stat " DEVREG_FILE);
+		goto err;
+	}
+	reg.valid = 1;
+
+	return 0;
+
+err:
+	/* the cache is good for this lookup only */
+	if (unlink(DEVREG_FILE) && errno != ENOENT)
+		ploop_err(errno, "Can't remove " DEVREG_FILE);
+	reg.valid = 0;
+	return -1;
+}
+
+/* Base delta and cookie of a device, as ploop_get_dev_by_delta() used
+ * to read them. Return: 0 ok, 1 no such device or no delta, -1 error
+ */
+static int read_dev_attrs(const char *name, char *image, int ilen,
+		char *cookie, int clen)
+{
+	char fname[PATH_MAX];
+	int err;
+
+	snprintf(fname, sizeof(fname), "/sys/block/%s/pdelta/0/image", name);
+	err = read_line_quiet(fname, image, ilen);
+	if (err == 0) {
+		snprintf(fname, sizeof(fname), "/sys/block/%s/pstate/cookie",
+				name);
+		err = read_line_quiet(fname, cookie, clen);
+	}
+	if (err == 0)
+		return 0;
+	/* This is not an error, but a race between
+	 * mount and umount: device is being removed
+	 */
+	if (err == ENOENT || err == ENODEV)
+		return 1;
+
+	ploop_err(err, "Can't open or read %s", fname);
+	return -1;
+}
+
+static int devreg_scan(void)
+{
+	DIR *dp;
+	struct dirent *de;
+	char image[PATH_MAX];
+	char cookie[PLOOP_COOKIE_SIZE];
+	int ret;
+
+	ploop_log(3, "Rebuilding device index");
+	devreg_clear();
+
+	dp = opendir("/sys/block");
+	if (dp == NULL) {
+		ploop_err(errno, "Can't opendir /sys/block");
+		return -1;
+	}
+
+	while ((de = readdir(dp)) != NULL) {
+		if (strncmp("ploop", de->d_name, 5))
+			continue;
+
+		ret = read_dev_attrs(de->d_name, image, sizeof(image),
+				cookie, sizeof(cookie));
+		if (ret == 1)
+			continue;
+		if (ret == -1 || devreg_append(de->d_name, cookie, image))
+			goto err;
+	}
+	closedir(dp);
+
+	devreg_rehash();
+	devreg_save();
+	reg.set_ok = 1;
+
+	return 0;
+
+err:
+	closedir(dp);
+	devreg_clear();
+	return -1;
+}
+
+static int name_cmp(const void *a, const void *b)
+{
+	return strcmp(*(const char **)a, *(const char **)b);
+}
+
+/* Are the started devices in /sys/block the ones in the index?
+ * Return: 0 yes, 1 no, -1 error
+ */
+static int devreg_check_set(void)
+{
+	DIR *dp;
+	struct dirent *de;
+	struct stat st;
+	char fname[PATH_MAX];
+	const char **names;
+	const char *name;
+	int i, n = 0, ret = 0;
+
+	names = malloc((reg.n + 1) * sizeof(char *));
+	if (names == NULL) {
+		ploop_err(ENOMEM, "Memory allocation failed");
+		return -1;
+	}
+	for (i = 0; i < reg.n; i++)
+		names[i] = reg.e[i].name;
+	qsort(names, reg.n, sizeof(char *), name_cmp);
+
+	dp = opendir("/sys/block");
+	if (dp == NULL) {
+		ploop_err(errno, "Can't opendir /sys/block");
+		free(names);
+		return -1;
+	}
+
+	while ((de = readdir(dp)) != NULL) {
+		if (strncmp("ploop", de->d_name, 5))
+			continue;
+
+		/* a started device has a delta */
+		snprintf(fname, sizeof(fname), "/sys/block/%s/pdelta/0",
+				de->d_name);
+		if (stat(fname, &st))
+			continue;
+
+		name = de->d_name;
+		if (bsearch(&name, names, reg.n, sizeof(char *),
+					name_cmp) == NULL) {
+			ploop_log(1, "Device %s is not indexed", name);
+			ret = 1;
+			break;
+		}
+		n++;
+	}
+	closedir(dp);
+	free(names);
+
+	if (ret == 0 && n != reg.n) {
+		ploop_log(1, "Indexed device is gone");
+		ret = 1;
+	}
+
+	return ret;
+}
+
+/* Return: 0 found, 1 not found, 2 the index is stale, -1 error */
+static int devreg_find(const char *component_name, const char *image,
+		char **out[])
+{
+	char s_image[PATH_MAX];
+	char s_cookie[PLOOP_COOKIE_SIZE];
+	char **t;
+	int i, ret, nelem = 1;
+
+	for (i = reg.hash[devreg_hash(image)]; i != -1; i = reg.e[i].next) {
+		struct devreg_entry *e = &reg.e[i];
+		char dev[sizeof(e->name) + 5];
+
+		if (strcmp(e->image, image))
+			continue;
+		if (component_name &&
+				strncmp(component_name, e->cookie, sizeof(e->cookie)))
+			continue;
+
+		ret = read_dev_attrs(e->name, s_image, sizeof(s_image),
+				s_cookie, sizeof(s_cookie));
+		if (ret == -1)
+			goto err;
+		if (ret == 1 || strcmp(s_image, e->image) ||
+				strcmp(s_cookie, e->cookie)) {
+			ploop_log(1, "Device index is stale: %s", e->name);
+			ret = 2;
+			goto err;
+		}
+
+		snprintf(dev, sizeof(dev), "/dev/%s", e->name);
+		t = realloc(*out, (nelem + 1) * sizeof(char *));
+		if (t == NULL) {
+			ploop_err(ENOMEM, "Memory allocation failed");
+			ret = -1;
+			goto err;
+		}
+		*out = t;
+		if ((t[nelem - 1] = strdup(dev)) == NULL) {
+			ploop_err(ENOMEM, "Memory allocation failed");
+			ret = -1;
+			goto err;
+		}
+		t[nelem++] = NULL;
+		if (component_name)
+			break;
+	}
+
+	return (nelem == 1);
+
+err:
+	ploop_free_array(*out);
+	*out = NULL;
+	return ret;
+}
+
+/* Find device(s) by the resolved base delta path, see
+ * ploop_get_dev_by_delta() for the arguments and return values.
+ */
+int devreg_get_dev(const char *component_name, const char *image,
+		char **out[])
+{
+	int ret;
+
+	*out = NULL;
+
+	if (devreg_load() && devreg_scan())
+		return -1;
+
+	ret = devreg_find(component_name, image, out);
+	/* a miss is only trusted if no device was started unnoticed */
+	if (ret == 1 && !reg.set_ok) {
+		ret = devreg_check_set();
+		if (ret == -1)
+			return -1;
+		if (ret == 0) {
+			reg.set_ok = 1;
+			return 1;
+		}
+		ret = 2;
+	}
+	if (ret == 2) {
+		if (devreg_scan())
+			return -1;
+		ret = devreg_find(component_name, image, out);
+	}
+
+	return ret == 2 ? -1 : ret;
+}
+
+/* Drop the global lock taken for devreg_get_dev(); the devices may be
+ * started or stopped by others from now on
+ */
+void devreg_unlock(int lckfd)
+{
+	reg.set_ok = 0;
+	close(lckfd);
+}
+
+static int devreg_lock(void)
+{
+	int lckfd;
+
+	lckfd = ploop_global_lock();
+	if (lckfd == -1)
+		return -1;
+
+	if (devreg_load()) {
+		/* nothing to update, the next lookup will scan */
+		close(lckfd);
+		return -1;
+	}
+
+	return lckfd;
+}
+
+static const char *dev_name(const char *device)
+{
+	const char *p = strrchr(device, '/');
+
+	return p ? p + 1 : device;
+}
+
+static void devreg_remove(const char *name)
+{
+	int i;
+
+	for (i = 0; i < reg.n; i++) {
+		if (strcmp(reg.e[i].name, name))
+			continue;
+		free(reg.e[i].image);
+		reg.e[i--] = reg.e[--reg.n];
+	}
+}
+
+/* Record a device just started */
+void devreg_add(const char *device)
+{
+	const char *name = dev_name(device);
+	char image[PATH_MAX];
+	char cookie[PLOOP_COOKIE_SIZE];
+	int lckfd;
+
+	lckfd = devreg_lock();
+	if (lckfd == -1)
+		return;
+
+	devreg_remove(name);
+	if (read_dev_attrs(name, image, sizeof(image), cookie, sizeof(cookie)) ||
+			devreg_append(name, cookie, image))
+		devreg_drop();
+	else {
+		devreg_rehash();
+		devreg_save();
+	}
+
+	devreg_unlock(lckfd);
+}
+
+/* Forget a device just cleared */
+void devreg_del(const char *device)
+{
+	int lckfd;
+
+	lckfd = devreg_lock();
+	if (lckfd == -1)
+		return;
+
+	devreg_remove(dev_name(device));
+	devreg_rehash();
+	devreg_save();
+
+	devreg_unlock(lckfd);
+}
+
+/* Drop the index, so the next lookup rebuilds it from sysfs */
+void ploop_devreg_invalidate(void)
+{
+	int lckfd;
+
+	lckfd = ploop_global_lock();
+	if (lckfd == -1)
+		return;
+
+	devreg_drop();
+
+	devreg_unlock(lckfd);
+}
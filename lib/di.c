@@ -20,6 +20,7 @@
 #include <limits.h>
 #include <stdlib.h>
 #include <string.h>
+#include <ctype.h>
 #include <libxml/parser.h>
 #include <libxml/tree.h>
 #include <libxml/xmlwriter.h>
@@ -27,6 +28,106 @@
 
 #include "ploop.h"
 
+/* Hash index of the images and snapshots by guid, and of the snapshots
+ * by parent guid. It is built on the first lookup and dropped by the
+ * functions changing the arrays or the guids. The chains keep the array
+ * order, so the lookups return the same entry a linear scan would.
+ */
+struct di_index {
+	int nimages;
+	int nsnapshots;
+	unsigned int mask;
+	int *image_head;
+	int *snap_head;
+	int *child_head;
+	int *image_next;
+	int *snap_next;
+	int *child_next;
+};
+
+static unsigned int guid_hash(const char *guid)
+{
+	unsigned int h = 2166136261u;
+
+	/* guidcmp() ignores case */
+	for (; *guid != '\0'; guid++)
+		h = (h ^ tolower((unsigned char)*guid)) * 16777619u;
+
+	return h;
+}
+
+static void di_index_drop(struct ploop_disk_images_data *di)
+{
+	struct di_index *idx = di->runtime->index;
+
+	if (idx == NULL)
+		return;
+
+	free(idx->image_head);
+	free(idx->image_next);
+	free(idx->snap_next);
+	free(idx);
+	di->runtime->index = NULL;
+}
+
+/* Return the index, or NULL to fall back to a linear scan */
+static struct di_index *di_index_get(struct ploop_disk_images_data *di)
+{
+	struct di_index *idx = di->runtime->index;
+	unsigned int h, n;
+	int i;
+
+	if (idx != NULL && idx->nimages == di->nimages &&
+			idx->nsnapshots == di->nsnapshots)
+		return idx;
+	di_index_drop(di);
+
+	for (n = 16; n < 2 * (di->nimages + di->nsnapshots); n <<= 1)
+		;
+
+	idx = calloc(1, sizeof(struct di_index));
+	if (idx == NULL)
+		return NULL;
+	idx->image_head = malloc(3 * n * sizeof(int));
+	idx->image_next = malloc((di->nimages + 1) * sizeof(int));
+	idx->snap_next = malloc(2 * (di->nsnapshots + 1) * sizeof(int));
+	if (idx->image_head == NULL || idx->image_next == NULL ||
+			idx->snap_next == NULL) {
+		free(idx->image_head);
+		free(idx->image_next);
+		free(idx->snap_next);
+		free(idx);
+		return NULL;
+	}
+	idx->snap_head = idx->image_head + n;
+	idx->child_head = idx->snap_head + n;
+	idx->child_next = idx->snap_next + di->nsnapshots + 1;
+	idx->mask = n - 1;
+	idx->nimages = di->nimages;
+	idx->nsnapshots = di->nsnapshots;
+	memset(idx->image_head, 0xff, 3 * n * sizeof(int));
+
+	/* insert backwards, so the first entry is at the chain head */
+	for (i = di->nimages - 1; i >= 0; i--) {
+		h = guid_hash(di->images[i]->guid) & idx->mask;
+		idx->image_next[i] = idx->image_head[h];
+		idx->image_head[h] = i;
+	}
+	for (i = di->nsnapshots - 1; i >= 0; i--) {
+		h = guid_hash(di->snapshots[i]->guid) & idx->mask;
+		idx->snap_next[i] = idx->snap_head[h];
+		idx->snap_head[h] = i;
+
+		h = guid_hash(di->snapshots[i]->parent_guid) & idx->mask;
+		idx->child_next[i] = idx->child_head[h];
+		idx->child_head[h] = i;
+	}
+
+	di->runtime->index = idx;
+
+	return idx;
+}
+
 static void free_image_data(struct ploop_image_data *data)
 {
 	if (data != NULL) {
@@ -76,6 +177,7 @@ int ploop_add_image_entry(struct ploop_disk_images_data *di, const char *fname,
 
 	di->images[di->nimages] = image;
 	di->nimages++;
+	di_index_drop(di);
 
 	return 0;
 }
@@ -130,6 +232,7 @@ int ploop_add_snapshot_entry(struct ploop_disk_images_data *di, const char *guid
 
 	di->snapshots[di->nsnapshots] = data;
 	di->nsnapshots++;
+	di_index_drop(di);
 
 	return 0;
 }
@@ -167,6 +270,7 @@ void ploop_di_change_guid(struct ploop_disk_images_data *di, const char *guid, c
 {
 	int i;
 
+	di_index_drop(di);
 	for (i = 0; i < di->nimages; i++)
 		if (guidcmp(di->images[i]->guid, guid) == 0)
 			strcpy(di->images[i]->guid, new_guid);
@@ -219,14 +323,24 @@ void ploop_free_diskdescriptor(struct ploop_disk_images_data *di)
 	free(di->top_guid);
 	free(di->runtime->xml_fname);
 	free(di->runtime->component_name);
+	di_index_drop(di);
 	free(di->runtime);
 	free(di);
 }
 
 int find_image_idx_by_guid(struct ploop_disk_images_data *di, const char *guid)
 {
+	struct di_index *idx = di_index_get(di);
 	int i;
 
+	if (idx != NULL) {
+		for (i = idx->image_head[guid_hash(guid) & idx->mask]; i != -1;
+				i = idx->image_next[i])
+			if (!guidcmp(guid, di->images[i]->guid))
+				return i;
+		return -1;
+	}
+
 	for (i = 0; i < di->nimages; i++) {
 		if (!guidcmp(guid, di->images[i]->guid))
 			return i;
@@ -250,10 +364,21 @@ char *find_image_by_guid(struct ploop_disk_images_data *di, const char *guid)
 
 int find_snapshot_by_guid(struct ploop_disk_images_data *di, const char *guid)
 {
+	struct di_index *idx;
 	int i;
 
 	if (guid == NULL)
 		return -1;
+
+	idx = di_index_get(di);
+	if (idx != NULL) {
+		for (i = idx->snap_head[guid_hash(guid) & idx->mask]; i != -1;
+				i = idx->snap_next[i])
+			if (guidcmp(di->snapshots[i]->guid, guid) == 0)
+				return i;
+		return -1;
+	}
+
 	for (i = 0; i < di->nsnapshots; i++)
 		if (guidcmp(di->snapshots[i]->guid, guid) == 0)
 			return i;
@@ -270,8 +395,19 @@ static void remove_data_from_array(void **array, int nelem, int id)
 
 int ploop_get_child_by_uuid(struct ploop_disk_images_data *di, const char *guid, char **child_guid)
 {
+	struct di_index *idx = di_index_get(di);
 	int i;
 
+	if (idx != NULL) {
+		for (i = idx->child_head[guid_hash(guid) & idx->mask]; i != -1;
+				i = idx->child_next[i])
+			if (guidcmp(di->snapshots[i]->parent_guid, guid) == 0) {
+				*child_guid = di->snapshots[i]->guid;
+				return 0;
+			}
+		return -1;
+	}
+
 	for (i = 0; i < di->nsnapshots; i++) {
 		if (guidcmp(di->snapshots[i]->parent_guid, guid) == 0) {
 			*child_guid = di->snapshots[i]->guid;
@@ -295,8 +431,17 @@ char *ploop_find_parent_by_guid(struct ploop_disk_images_data *di, const char *g
 
 int ploop_get_child_count_by_uuid(struct ploop_disk_images_data *di, const char *guid)
 {
+	struct di_index *idx = di_index_get(di);
 	int i, n = 0;
 
+	if (idx != NULL) {
+		for (i = idx->child_head[guid_hash(guid) & idx->mask]; i != -1;
+				i = idx->child_next[i])
+			if (guidcmp(di->snapshots[i]->parent_guid, guid) == 0)
+				n++;
+		return n;
+	}
+
 	for (i = 0; i < di->nsnapshots; i++)
 		if (guidcmp(di->snapshots[i]->parent_guid, guid) == 0)
 			n++;
@@ -353,6 +498,7 @@ int ploop_di_remove_image(struct ploop_disk_images_data *di, const char *guid,
 	di->nsnapshots--;
 	remove_data_from_array((void**)di->images, di->nimages, image_id);
 	di->nimages--;
+	di_index_drop(di);
 
 	free_snapshot_data(snapshot);
 	free_image_data(image);
@@ -404,6 +550,7 @@ int ploop_di_merge_image(struct ploop_disk_images_data *di, const char *guid, ch
 	/* Caller passed child_guid S2 to delete S1 (S1 <- S2 <- S3) (S2 <- S3)
 	 * so it has merge S2 to S1 and we should update all S1 referrences to S2
 	 */
+	di_index_drop(di);
 	for (i = 0; i < di->nsnapshots; i++)
 		if (guidcmp(di->snapshots[i]->guid, snapshot->parent_guid) == 0)
 			strcpy(di->snapshots[i]->guid, guid);
@@ -0,0 +1,396 @@
+/*
+ *  Copyright (C) 2008-2012, Parallels, Inc. All rights reserved.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/* Discard scheduler.
+ *
+ * Looks over all mounted ploop devices of the node, estimates how much
+ * space each image could give back and runs ploop_discard_by_dev() on the
+ * most profitable ones. Every run frees a limited step only, the number
+ * of simultaneous runs is limited, and the total amount of space handed
+ * to the runs is paced by a token bucket, so the relocation I/O of the
+ * whole node is spread over time instead of coming in bursts. The runs
+ * are threads of the caller, a stop request is passed on to them.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <unistd.h>
+#include <limits.h>
+#include <string.h>
+#include <signal.h>
+#include <time.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <linux/types.h>
+
+#include "ploop.h"
+
+#define DEF_DISCARD_STEP	(1ULL << 30)	/* 1G per run */
+#define DEF_DISCARD_MIN_GAIN	(64ULL << 20)
+
+struct discard_cand {
+	char device[PATH_MAX];
+	char mnt[PATH_MAX];
+	__u64 gain;
+};
+
+struct discard_job {
+	pthread_t thread;
+	char device[PATH_MAX];
+	char mnt[PATH_MAX];
+	__u64 minlen_b;
+	__u64 to_free;
+	int stop;		/* read by ploop_discard_by_dev() */
+	int done;		/* under discard_sched.lock */
+	int ret;
+	pthread_mutex_t *lock;
+};
+
+struct discard_sched {
+	struct ploop_discard_sched_param *param;
+	struct discard_job **jobs;
+	int n_jobs;
+	int stopped;
+	pthread_mutex_t lock;
+	/* token bucket, bytes */
+	double tokens;
+	struct timespec last;
+};
+
+static int sched_stopped(struct discard_sched *s)
+{
+	/* reading the cancel flag clears it, so latch it here */
+	if (!s->stopped)
+		s->stopped = (s->param->stop && *s->param->stop) ||
+			is_operation_cancelled();
+	return s->stopped;
+}
+
+static int cand_cmp(const void *a, const void *b)
+{
+	const struct discard_cand *x = a, *y = b;
+
+	if (x->gain != y->gain)
+		return x->gain < y->gain ? 1 : -1;
+	return strcmp(x->device, y->device);
+}
+
+static int is_job_running(struct discard_sched *s, const char *device)
+{
+	int i;
+
+	for (i = 0; i < s->n_jobs; i++)
+		if (strcmp(s->jobs[i]->device, device) == 0)
+			return 1;
+	return 0;
+}
+
+/* Space a discard with our minlen can give back. Without the free
+ * extent histogram, take the whole difference between image and data.
+ */
+static __u64 estimate_gain(struct discard_sched *s,
+		struct ploop_discard_stat_ex *st)
+{
+	int i = 0;
+	__u64 gain;
+
+	gain = st->stat.image_size > st->stat.data_size ?
+		st->stat.image_size - st->stat.data_size : 0;
+	if (!st->hist_valid)
+		return gain;
+
+	/* the first bucket whose extents are all >= minlen */
+	while (i < PLOOP_FREE_HIST_SIZE - 1 &&
+			((__u64)st->cluster << i) < s->param->minlen_b)
+		i++;
+
+	return st->reclaimable[i] < gain ? st->reclaimable[i] : gain;
+}
+
+/* Collect the mounted ploop devices worth discarding, best first */
+static int get_candidates(struct discard_sched *s,
+		struct discard_cand **cand_p, int *n_p)
+{
+	DIR *dp;
+	struct dirent *de;
+	struct discard_cand *cand = NULL, *t;
+	struct ploop_discard_stat_ex st;
+	char fname[PATH_MAX];
+	char image[PATH_MAX];
+	char device[PATH_MAX];
+	char mnt[PATH_MAX];
+	int n = 0;
+	__u64 gain;
+
+	dp = opendir("/sys/block");
+	if (dp == NULL) {
+		ploop_err(errno, "Can't opendir /sys/block");
+		return SYSEXIT_SYSFS;
+	}
+
+	while ((de = readdir(dp)) != NULL) {
+		if (strncmp("ploop", de->d_name, 5))
+			continue;
+
+		snprintf(fname, sizeof(fname), "/sys/block/%s/pdelta/0/image",
+				de->d_name);
+		if (read_line_quiet(fname, image, sizeof(image)))
+			continue;
+
+		snprintf(device, sizeof(device), "/dev/%s", de->d_name);
+		if (is_job_running(s, device))
+			continue;
+		if (ploop_get_mnt_by_dev(device, mnt, sizeof(mnt)))
+			continue;
+		if (ploop_discard_get_stat_ex_by_dev(device, mnt, &st))
+			continue;
+
+		gain = estimate_gain(s, &st);
+		ploop_log(3, "%s: image %lluMB data %lluMB gain %lluMB", device,
+				(unsigned long long)st.stat.image_size >> 20,
+				(unsigned long long)st.stat.data_size >> 20,
+				(unsigned long long)gain >> 20);
+		if (gain < s->param->min_gain)
+			continue;
+
+		t = realloc(cand, (n + 1) * sizeof(struct discard_cand));
+		if (t == NULL) {
+			ploop_err(ENOMEM, "realloc");
+			free(cand);
+			closedir(dp);
+			return SYSEXIT_MALLOC;
+		}
+		cand = t;
+		snprintf(cand[n].device, sizeof(cand[n].device), "%s", device);
+		snprintf(cand[n].mnt, sizeof(cand[n].mnt), "%s", mnt);
+		cand[n].gain = gain;
+		n++;
+	}
+	closedir(dp);
+
+	if (n)
+		qsort(cand, n, sizeof(struct discard_cand), cand_cmp);
+
+	*cand_p = cand;
+	*n_p = n;
+
+	return 0;
+}
+
+static void refill_tokens(struct discard_sched *s)
+{
+	struct timespec now;
+	double cap;
+
+	if (s->param->bw_limit == 0)
+		return;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	s->tokens += ((now.tv_sec - s->last.tv_sec) +
+		(now.tv_nsec - s->last.tv_nsec) / 1e9) * s->param->bw_limit;
+	s->last = now;
+
+	/* do not let an idle period turn into a burst */
+	cap = s->param->step > s->param->bw_limit ?
+		s->param->step : s->param->bw_limit;
+	if (s->tokens > cap)
+		s->tokens = cap;
+}
+
+/* Collect the finished jobs. With @block, wait until one finishes. */
+static void reap_jobs(struct discard_sched *s, int block)
+{
+	struct discard_job *job;
+	int i, done, reaped = 0;
+
+	for (;;) {
+		for (i = 0; i < s->n_jobs; ) {
+			job = s->jobs[i];
+			if (s->stopped)
+				job->stop = 1;
+
+			pthread_mutex_lock(&s->lock);
+			done = job->done;
+			pthread_mutex_unlock(&s->lock);
+			if (!done) {
+				i++;
+				continue;
+			}
+
+			pthread_join(job->thread, NULL);
+			if (job->ret == 0)
+				ploop_log(0, "Discard of %s done", job->device);
+			else
+				ploop_err(0, "Discard of %s failed: %d",
+						job->device, job->ret);
+
+			free(job);
+			s->jobs[i] = s->jobs[--s->n_jobs];
+			reaped++;
+		}
+
+		if (!block || reaped || s->n_jobs == 0)
+			break;
+		usleep(100000);
+	}
+}
+
+static void *discard_job_fn(void *data)
+{
+	struct discard_job *job = data;
+	int ret;
+
+	ret = ploop_discard_by_dev(job->device, job->mnt, job->minlen_b,
+			job->to_free, &job->stop);
+
+	pthread_mutex_lock(job->lock);
+	job->ret = ret;
+	job->done = 1;
+	pthread_mutex_unlock(job->lock);
+
+	return NULL;
+}
+
+static int start_job(struct discard_sched *s, struct discard_cand *c,
+		__u64 to_free)
+{
+	struct discard_job *job;
+	int ret;
+
+	ploop_log(0, "Discard %s %s: expected gain %lluMB, freeing up to %lluMB",
+			c->device, c->mnt, (unsigned long long)c->gain >> 20,
+			(unsigned long long)to_free >> 20);
+
+	job = calloc(1, sizeof(struct discard_job));
+	if (job == NULL) {
+		ploop_err(ENOMEM, "calloc");
+		return SYSEXIT_MALLOC;
+	}
+	snprintf(job->device, sizeof(job->device), "%s", c->device);
+	snprintf(job->mnt, sizeof(job->mnt), "%s", c->mnt);
+	job->minlen_b = s->param->minlen_b;
+	job->to_free = to_free;
+	job->lock = &s->lock;
+
+	ret = pthread_create(&job->thread, NULL, discard_job_fn, job);
+	if (ret) {
+		ploop_err(ret, "Can't create thread");
+		free(job);
+		return SYSEXIT_SYS;
+	}
+	s->jobs[s->n_jobs++] = job;
+
+	return 0;
+}
+
+/* Run discard on the candidates of one scan, respecting the limits */
+static int run_pass(struct discard_sched *s)
+{
+	struct discard_cand *cand = NULL;
+	int i, n = 0, ret;
+	__u64 to_free;
+
+	ret = get_candidates(s, &cand, &n);
+	if (ret)
+		return ret;
+
+	ploop_log(1, "Discard candidates: %d", n);
+	for (i = 0; i < n && !sched_stopped(s); i++) {
+		while (s->n_jobs >= s->param->max_jobs && !sched_stopped(s))
+			reap_jobs(s, 1);
+		if (sched_stopped(s))
+			break;
+
+		to_free = cand[i].gain < s->param->step ?
+			cand[i].gain : s->param->step;
+
+		if (s->param->bw_limit) {
+			refill_tokens(s);
+			while (s->tokens < to_free && !sched_stopped(s)) {
+				reap_jobs(s, 0);
+				sleep(1);
+				refill_tokens(s);
+			}
+			if (sched_stopped(s))
+				break;
+			s->tokens -= to_free;
+		}
+
+		ret = start_job(s, &cand[i], to_free);
+		if (ret)
+			break;
+	}
+
+	free(cand);
+
+	return ret;
+}
+
+int ploop_discard_schedule(struct ploop_discard_sched_param *param)
+{
+	struct ploop_discard_sched_param p = *param;
+	struct discard_sched s = {};
+	int ret, t;
+
+	if (p.max_jobs <= 0)
+		p.max_jobs = 1;
+	if (p.step == 0)
+		p.step = DEF_DISCARD_STEP;
+	if (p.min_gain == 0)
+		p.min_gain = DEF_DISCARD_MIN_GAIN;
+
+	s.param = &p;
+	s.jobs = calloc(p.max_jobs, sizeof(struct discard_job *));
+	if (s.jobs == NULL) {
+		ploop_err(ENOMEM, "calloc");
+		return SYSEXIT_MALLOC;
+	}
+	pthread_mutex_init(&s.lock, NULL);
+	clock_gettime(CLOCK_MONOTONIC, &s.last);
+	/* allow the first run to start right away */
+	s.tokens = p.step;
+
+	ploop_log(0, "Discard scheduler: jobs=%d step=%lluMB min-gain=%lluMB"
+			" rate=%lluKB/s interval=%ds", p.max_jobs,
+			(unsigned long long)p.step >> 20,
+			(unsigned long long)p.min_gain >> 20,
+			(unsigned long long)p.bw_limit >> 10, p.interval);
+
+	do {
+		ret = run_pass(&s);
+		if (ret || p.interval <= 0)
+			break;
+
+		for (t = 0; t < p.interval && !sched_stopped(&s); t++) {
+			reap_jobs(&s, 0);
+			sleep(1);
+		}
+	} while (!sched_stopped(&s));
+
+	/* the running jobs are bounded by the step; on a stop they are
+	 * told to finish early
+	 */
+	while (s.n_jobs)
+		reap_jobs(&s, 1);
+
+	pthread_mutex_destroy(&s.lock);
+	free(s.jobs);
+
+	return ret;
+}
@@ -0,0 +1,259 @@
+/*
+ *  Copyright (C) 2008-2012, Parallels, Inc. All rights reserved.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/* Allocation journal.
+ *
+ * The journal is a small sidecar file kept next to the writable top delta
+ * while it is mounted. At mount time it records a checkpoint: the number
+ * of clusters in the (just checked) image. While mounted, the kernel
+ * allocates new blocks only past that point, except for the blocks handed
+ * back to it by PLOOP_IOC_FREEBLKS; those ranges are appended to the
+ * journal before the ioctl. After a crash ploop_check() only has to look
+ * for sparse blocks in the journaled ranges and in the tail past the
+ * checkpoint. Any operation the journal can not follow drops it, and the
+ * check falls back to the full scan.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <limits.h>
+#include <string.h>
+#include <stddef.h>
+#include <sys/stat.h>
+#include <linux/types.h>
+
+#include "ploop.h"
+
+#define ALLOC_JOURNAL_FNAME(fname, image) \
+	snprintf(fname, sizeof(fname), "%s.alloc", image)
+#define ALLOC_JOURNAL_MAGIC	0x414c4331 /* "ALC1" */
+
+static __u32 alloc_journal_csum(struct alloc_journal *aj)
+{
+	return ploop_crc32((unsigned char *)aj,
+			offsetof(struct alloc_journal, csum)) ^
+		ploop_crc32((unsigned char *)aj->ranges,
+			aj->nr_ranges * sizeof(aj->ranges[0]));
+}
+
+static int write_alloc_journal(const char *image, struct alloc_journal *aj)
+{
+	int fd, ret = 0;
+	size_t len;
+	char fname[PATH_MAX];
+
+	ALLOC_JOURNAL_FNAME(fname, image);
+	fd = open(fname, O_WRONLY|O_CREAT|O_TRUNC, 0600);
+	if (fd == -1) {
+		ploop_err(errno, "Can't create %s", fname);
+		return SYSEXIT_CREAT;
+	}
+
+	aj->csum = alloc_journal_csum(aj);
+	len = offsetof(struct alloc_journal, ranges) +
+		aj->nr_ranges * sizeof(aj->ranges[0]);
+	if (pwrite(fd, aj, len, 0) != len) {
+		ploop_err(errno, "Can't write %s", fname);
+		ret = SYSEXIT_WRITE;
+	} else if (fsync(fd)) {
+		ploop_err(errno, "fsync %s", fname);
+		ret = SYSEXIT_FSYNC;
+	}
+	close(fd);
+
+	if (ret)
+		unlink(fname);
+
+	return ret;
+}
+
+/* Returns 0 if a valid journal for the image was read, 1 otherwise */
+int alloc_journal_read(const char *image, struct alloc_journal **aj_p)
+{
+	int fd, n;
+	struct stat st;
+	struct alloc_journal *aj;
+	char fname[PATH_MAX];
+
+	*aj_p = NULL;
+	ALLOC_JOURNAL_FNAME(fname, image);
+	fd = open(fname, O_RDONLY);
+	if (fd == -1) {
+		if (errno != ENOENT)
+			ploop_err(errno, "Can't open %s", fname);
+		return 1;
+	}
+
+	aj = malloc(sizeof(*aj));
+	if (aj == NULL) {
+		ploop_err(ENOMEM, "malloc");
+		close(fd);
+		return 1;
+	}
+
+	n = read(fd, aj, sizeof(*aj));
+	close(fd);
+	if (n < offsetof(struct alloc_journal, ranges) ||
+			aj->magic != ALLOC_JOURNAL_MAGIC ||
+			aj->nr_ranges > ALLOC_JOURNAL_MAX_RANGES ||
+			n != offsetof(struct alloc_journal, ranges) +
+				aj->nr_ranges * sizeof(aj->ranges[0]) ||
+			aj->csum != alloc_journal_csum(aj))
+		goto bad;
+
+	/* the journal has to belong to this very file */
+	if (stat(image, &st) || st.st_ino != aj->ino)
+		goto bad;
+
+	*aj_p = aj;
+	return 0;
+
+bad:
+	ploop_log(0, "Ignoring inconsistent allocation journal %s", fname);
+	free(aj);
+	return 1;
+}
+
+int alloc_journal_checkpoint(const char *image, __u32 blocksize)
+{
+	int ret;
+	struct stat st;
+	struct alloc_journal *aj;
+
+	if (stat(image, &st)) {
+		ploop_err(errno, "Can't stat %s", image);
+		return SYSEXIT_FSTAT;
+	}
+
+	if (alloc_journal_read(image, &aj)) {
+		aj = calloc(1, sizeof(*aj));
+		if (aj == NULL) {
+			ploop_err(ENOMEM, "calloc");
+			return SYSEXIT_MALLOC;
+		}
+	}
+
+	aj->magic = ALLOC_JOURNAL_MAGIC;
+	aj->blocksize = blocksize;
+	aj->generation++;
+	aj->ino = st.st_ino;
+	aj->alloc_head = (st.st_size + S2B(blocksize) - 1) / S2B(blocksize);
+	aj->nr_ranges = 0;
+
+	ploop_log(0, "Allocation journal checkpoint %s gen=%u a_h=%u",
+			image, aj->generation, aj->alloc_head);
+	ret = write_alloc_journal(image, aj);
+	free(aj);
+
+	return ret;
+}
+
+int alloc_journal_drop(const char *image)
+{
+	char fname[PATH_MAX];
+
+	ALLOC_JOURNAL_FNAME(fname, image);
+	if (unlink(fname) && errno != ENOENT) {
+		ploop_err(errno, "Can't unlink %s", fname);
+		return SYSEXIT_UNLINK;
+	}
+
+	return 0;
+}
+
+static int add_range(struct alloc_journal *aj, __u32 iblk, __u32 len)
+{
+	__u32 i;
+
+	/* blocks beyond the checkpoint are covered by the tail scan */
+	if (iblk >= aj->alloc_head)
+		return 0;
+	if (iblk + len > aj->alloc_head)
+		len = aj->alloc_head - iblk;
+
+	for (i = 0; i < aj->nr_ranges; i++) {
+		struct alloc_journal_range *r = &aj->ranges[i];
+
+		if (iblk <= r->iblk + r->len && r->iblk <= iblk + len) {
+			__u32 end = r->iblk + r->len;
+
+			if (end < iblk + len)
+				end = iblk + len;
+			if (r->iblk > iblk)
+				r->iblk = iblk;
+			r->len = end - r->iblk;
+			return 0;
+		}
+	}
+
+	if (aj->nr_ranges == ALLOC_JOURNAL_MAX_RANGES)
+		return -1;
+
+	aj->ranges[aj->nr_ranges].iblk = iblk;
+	aj->ranges[aj->nr_ranges].len = len;
+	aj->nr_ranges++;
+
+	return 0;
+}
+
+/* Record the blocks we are about to give the kernel for reuse.
+ * Has to be called before PLOOP_IOC_FREEBLKS.
+ */
+int alloc_journal_add_freeblks(const char *device,
+		struct ploop_freeblks_ctl *freeblks)
+{
+	int i, ret;
+	struct alloc_journal *aj;
+	char image[PATH_MAX];
+
+	if (ploop_find_top_delta_name_and_format(device, image, sizeof(image),
+				NULL, 0))
+		return SYSEXIT_SYSFS;
+
+	if (alloc_journal_read(image, &aj))
+		return 0;
+
+	for (i = 0; i < freeblks->n_extents; i++) {
+		if (add_range(aj, freeblks->extents[i].iblk,
+					freeblks->extents[i].len)) {
+			ploop_log(0, "Allocation journal overflow, dropping it");
+			free(aj);
+			return alloc_journal_drop(image);
+		}
+	}
+
+	ret = write_alloc_journal(image, aj);
+	free(aj);
+
+	return ret;
+}
+
+/* Drop the journal of the top delta of a running device */
+int alloc_journal_drop_dev(const char *device)
+{
+	char image[PATH_MAX];
+
+	if (ploop_find_top_delta_name_and_format(device, image, sizeof(image),
+				NULL, 0))
+		return SYSEXIT_SYSFS;
+
+	return alloc_journal_drop(image);
+}
@@ -32,6 +32,103 @@
 
 #include "ploop.h"
 
+#define MERGE_STATE_FNAME(fname, image)	snprintf(fname, sizeof(fname), "%s.merge", image)
+#define MERGE_STATE_MAGIC	0x4d524731 /* "MRG1" */
+
+/* do_merge_image() flags */
+#define MERGE_FILL_HOLES	0x1	/* copy only blocks absent in destination */
+
+/* Progress record of an offline merge, stored next to the destination
+ * delta. It is rewritten after each index cluster of the destination
+ * is committed, so an interrupted merge can continue from that point.
+ */
+struct merge_state {
+	__u32 magic;
+	__u32 blocksize;
+	__u32 version;
+	__u32 nr_deltas;	/* number of source deltas */
+	__u32 flags;		/* MERGE_* flags */
+	__u64 src_bytes;	/* total size of source delta files */
+	__u32 src_l2_size;	/* l2_size of the top source delta */
+	__u32 dst_l1_size;	/* l1_size of the destination (after grow) */
+	__s32 l2_cache;		/* last committed index cluster */
+	__u32 alloc_head;	/* destination alloc_head after the commit */
+	__u32 csum;
+};
+
+static __u32 merge_state_csum(struct merge_state *st)
+{
+	return ploop_crc32((unsigned char *)st,
+			offsetof(struct merge_state, csum));
+}
+
+static int read_merge_state(const char *fname, struct merge_state *st)
+{
+	int fd, n;
+
+	fd = open(fname, O_RDONLY);
+	if (fd == -1) {
+		if (errno == ENOENT)
+			return 1;
+		ploop_err(errno, "Can't open %s", fname);
+		return -1;
+	}
+	n = pread(fd, st, sizeof(*st), 0);
+	close(fd);
+	if (n != sizeof(*st) || st->magic != MERGE_STATE_MAGIC ||
+			st->csum != merge_state_csum(st)) {
+		ploop_log(0, "Ignoring corrupted merge checkpoint %s", fname);
+		return 1;
+	}
+
+	return 0;
+}
+
+static int write_merge_state(int fd, struct merge_state *st,
+		struct delta *odelta)
+{
+	/* sync_cache() skips the fsync if no index entry changed, but the
+	 * blocks copied over already mapped clusters still have to be on
+	 * disk before the checkpoint says they are done
+	 */
+	if (odelta->fops->fsync(odelta->fd)) {
+		ploop_err(errno, "fsync");
+		return SYSEXIT_FSYNC;
+	}
+
+	st->l2_cache = odelta->l2_cache;
+	st->alloc_head = odelta->alloc_head;
+	st->csum = merge_state_csum(st);
+
+	if (pwrite(fd, st, sizeof(*st), 0) != sizeof(*st)) {
+		ploop_err(errno, "Can't write merge checkpoint");
+		return SYSEXIT_WRITE;
+	}
+	if (fsync(fd)) {
+		ploop_err(errno, "fsync");
+		return SYSEXIT_FSYNC;
+	}
+
+	return 0;
+}
+
+static int get_src_bytes(struct delta_array *da, int n, __u64 *out)
+{
+	int i;
+	struct stat st;
+
+	*out = 0;
+	for (i = 0; i < n; i++) {
+		if (da->delta_arr[i].fops->fstat(da->delta_arr[i].fd, &st)) {
+			ploop_err(errno, "fstat");
+			return SYSEXIT_FSTAT;
+		}
+		*out += st.st_size;
+	}
+
+	return 0;
+}
+
 static int sync_cache(struct delta * delta)
 {
 	int skip = 0;
@@ -280,8 +377,8 @@ int get_delta_info(const char *device, struct merge_info *info)
 	return 0;
 }
 
-int merge_image(const char *device, int start_level, int end_level, int raw, int merge_top,
-		      char **images)
+static int do_merge_image(const char *device, int start_level, int end_level,
+		int raw, int merge_top, char **images, int flags)
 {
 	int last_delta = 0;
 	char **names = NULL;
@@ -295,6 +392,16 @@ int merge_image(const char *device, int start_level, int end_level, int raw, int
 	__u32 blocksize = 0;
 	__u32 prev_blocksize = 0;
 	int version = PLOOP_FMT_UNDEFINED;
+	char state_fname[PATH_MAX];
+	struct merge_state mstate = {};
+	struct merge_state saved = {};
+	int state_fd = -1;
+	int resume = 0;
+	int i_start = 0;
+	/* Running kernel caches block mappings of the deltas,
+	 * so we can't remap blocks under it.
+	 */
+	int cb_flags = device ? CB_BUFFERED : CB_NOFLAGS;
 
 	if (start_level >= end_level || start_level < 0) {
 		ploop_err(0, "Invalid parameters: start_level %d end_level %d",
@@ -372,12 +479,30 @@ int merge_image(const char *device, int start_level, int end_level, int raw, int
 	}
 	cluster = S2B(blocksize);
 	if (!raw) {
-		if (open_delta(&odelta, names[last_delta], O_RDWR,
-			       device ? OD_NOFLAGS : OD_OFFLINE)) {
+		int od_flags = device ? OD_NOFLAGS : OD_OFFLINE;
+
+		if (!device) {
+			MERGE_STATE_FNAME(state_fname, names[last_delta]);
+			ret = read_merge_state(state_fname, &saved);
+			if (ret == -1) {
+				ret = SYSEXIT_OPEN;
+				goto merge_done2;
+			}
+			resume = (ret == 0);
+			ret = 0;
+			if (resume)
+				od_flags |= OD_ALLOW_DIRTY;
+		}
+		if (open_delta(&odelta, names[last_delta], O_RDWR, od_flags)) {
 			ploop_err(errno, "open_delta");
 			ret = SYSEXIT_OPEN;
 			goto merge_done2;
 		}
+		/* The destination was repaired after the interrupted merge
+		 * (i.e. by ploop check), nothing to resume: start over.
+		 */
+		if (resume && !((struct ploop_pvd_header *)odelta.hdr0)->m_DiskInUse)
+			resume = 0;
 		if (dirty_delta(&odelta)) {
 			ploop_err(errno, "dirty_delta");
 			ret = SYSEXIT_WRITE;
@@ -403,6 +528,51 @@ int merge_image(const char *device, int start_level, int end_level, int raw, int
 			if ((ret = grow_delta(&odelta, get_SizeInSectors(vh),
 				   data_cache, NULL)))
 				goto merge_done;
+
+			mstate.magic = MERGE_STATE_MAGIC;
+			mstate.blocksize = blocksize;
+			mstate.version = version;
+			mstate.nr_deltas = last_delta;
+			mstate.flags = flags;
+			mstate.src_l2_size = da.delta_arr[0].l2_size;
+			mstate.dst_l1_size = odelta.l1_size;
+			if ((ret = get_src_bytes(&da, last_delta, &mstate.src_bytes)))
+				goto merge_done;
+
+			if (resume) {
+				/* odelta.alloc_head is taken from the file size,
+				 * it is never below the committed one and covers
+				 * clusters written after the last checkpoint.
+				 */
+				if (saved.blocksize != mstate.blocksize ||
+				    saved.version != mstate.version ||
+				    saved.nr_deltas != mstate.nr_deltas ||
+				    saved.flags != mstate.flags ||
+				    saved.src_bytes != mstate.src_bytes ||
+				    saved.src_l2_size != mstate.src_l2_size ||
+				    saved.dst_l1_size != mstate.dst_l1_size ||
+				    saved.alloc_head > odelta.alloc_head ||
+				    saved.l2_cache >= odelta.l1_size) {
+					ploop_err(0, "Merge checkpoint %s does not match "
+							"the images, unable to resume",
+							state_fname);
+					ret = SYSEXIT_PARAM;
+					goto merge_done;
+				}
+				i_start = saved.l2_cache + 1;
+				ploop_log(0, "Resuming merge from index cluster %d",
+						i_start);
+			}
+
+			state_fd = open(state_fname, O_WRONLY|O_CREAT, 0600);
+			if (state_fd == -1) {
+				ploop_err(errno, "Can't create %s", state_fname);
+				ret = SYSEXIT_OPEN;
+				goto merge_done;
+			}
+			if (!resume &&
+			    (ret = write_merge_state(state_fd, &mstate, &odelta)))
+				goto merge_done;
 		} else {
 			off_t src_size = get_SizeInSectors(vh);
 			off_t dst_size;
@@ -422,10 +592,21 @@ int merge_image(const char *device, int start_level, int end_level, int raw, int
 
 	i_end = (da.delta_arr[0].l2_size + PLOOP_MAP_OFFSET + cluster/4 - 1) /
 		(cluster/4);
-	for (i = 0; i < i_end; i++) {
+	for (i = i_start; i < i_end; i++) {
 		int k_start = 0;
 		int k_end   = cluster/4;
 
+		if (state_fd != -1 && is_operation_cancelled()) {
+			if (odelta.l2_cache >= 0 &&
+			    (ret = sync_cache(&odelta)) == 0)
+				ret = write_merge_state(state_fd, &mstate, &odelta);
+			if (ret == 0) {
+				ploop_log(0, "Merge cancelled, rerun it to resume");
+				ret = SYSEXIT_ABORT;
+			}
+			goto merge_done;
+		}
+
 		/* Load L2 table */
 		if (PREAD(&da.delta_arr[0], da.delta_arr[0].l2,
 			  cluster, (off_t)i * cluster)) {
@@ -451,6 +632,7 @@ int merge_image(const char *device, int start_level, int end_level, int raw, int
 
 		for (k = k_start; k < k_end; k++) {
 			int level2 = 0;
+			off_t src_off;
 
 			/* If entry is not present in base level,
 			 * lookup lower deltas.
@@ -464,28 +646,28 @@ int merge_image(const char *device, int start_level, int end_level, int raw, int
 					continue;
 			}
 
-			if (PREAD(&da.delta_arr[level2], data_cache, cluster,
-						S2B(ploop_ioff_to_sec(da.delta_arr[level2].l2[k],
-								blocksize, version)))) {
-				ret = SYSEXIT_READ;
-				goto merge_done;
-			}
+			src_off = S2B(ploop_ioff_to_sec(da.delta_arr[level2].l2[k],
+						blocksize, version));
 
 			if (raw) {
 				off_t opos;
 				opos = i * (cluster/4) + k - PLOOP_MAP_OFFSET;
-				if (PWRITE(&odelta, data_cache, cluster,
-					   opos*cluster)) {
-					ret = SYSEXIT_WRITE;
+				if ((ret = copy_delta_block(&da.delta_arr[level2],
+						src_off, &odelta, opos*cluster,
+						cluster, data_cache, cb_flags)))
 					goto merge_done;
-				}
 				continue;
 			}
 
 			if (i != odelta.l2_cache) {
-				if (odelta.l2_cache >= 0)
+				if (odelta.l2_cache >= 0) {
 					if ((ret = sync_cache(&odelta)))
 						goto merge_done;
+					if (state_fd != -1 &&
+					    (ret = write_merge_state(state_fd,
+							&mstate, &odelta)))
+						goto merge_done;
+				}
 
 				odelta.l2_cache = i;
 				if (PREAD(&odelta, odelta.l2, cluster,
@@ -506,13 +688,13 @@ int merge_image(const char *device, int start_level, int end_level, int raw, int
 				}
 				odelta.l2_dirty = 1;
 				allocated++;
-			}
-			if (PWRITE(&odelta, data_cache, cluster,
-						S2B(ploop_ioff_to_sec(odelta.l2[k],
-								blocksize, version)))) {
-				ret = SYSEXIT_WRITE;
+			} else if (flags & MERGE_FILL_HOLES)
+				continue;
+			if ((ret = copy_delta_block(&da.delta_arr[level2], src_off,
+					&odelta, S2B(ploop_ioff_to_sec(odelta.l2[k],
+							blocksize, version)),
+					cluster, data_cache, cb_flags)))
 				goto merge_done;
-			}
 		}
 	}
 
@@ -569,7 +751,13 @@ int merge_image(const char *device, int start_level, int end_level, int raw, int
 		}
 	}
 
+	if (state_fd != -1 && ret == 0 &&
+	    unlink(state_fname) && errno != ENOENT)
+		ploop_err(errno, "Failed to unlink %s", state_fname);
+
 merge_done:
+	if (state_fd != -1)
+		close(state_fd);
 	close_delta(&odelta);
 
 	if (device && !ret) {
@@ -606,7 +794,133 @@ merge_done2:
 	return ret;
 }
 
-int ploop_merge_snapshot_by_guid(struct ploop_disk_images_data *di, const char *guid, int merge_mode)
+int merge_image(const char *device, int start_level, int end_level, int raw, int merge_top,
+		      char **images)
+{
+	return do_merge_image(device, start_level, end_level, raw, merge_top,
+			images, 0);
+}
+
+static int load_l2_cluster(struct delta *delta, int i)
+{
+	__u64 cluster = S2B(delta->blocksize);
+
+	if (i >= delta->l1_size) {
+		memset(delta->l2, 0, cluster);
+		return 0;
+	}
+	if (PREAD(delta, delta->l2, cluster, (off_t)i * cluster))
+		return SYSEXIT_READ;
+
+	return 0;
+}
+
+/* Estimate the amount of data moved by merging @child into @parent
+ * (to_parent) and by filling the holes of @child from @parent
+ * (to_child). The latter is only possible if both deltas have the
+ * same format and the child is not smaller than the parent, otherwise
+ * *reversible is set to 0.
+ */
+static int estimate_merge_cost(const char *child, const char *parent,
+		__u64 *to_parent, __u64 *to_child, int *reversible)
+{
+	struct delta c = {};
+	struct delta p = {};
+	__u64 cluster;
+	__u32 k, k_end, slot, n_child = 0, n_parent = 0;
+	int i, i_end, ret;
+
+	if (open_delta(&c, child, O_RDONLY, OD_ALLOW_DIRTY | OD_OFFLINE))
+		return SYSEXIT_OPEN;
+	if (open_delta(&p, parent, O_RDONLY, OD_ALLOW_DIRTY | OD_OFFLINE)) {
+		ret = SYSEXIT_OPEN;
+		goto err;
+	}
+
+	*reversible = (c.blocksize == p.blocksize &&
+			c.version == p.version &&
+			c.l2_size >= p.l2_size);
+
+	cluster = S2B(c.blocksize);
+	i_end = c.l1_size;
+	if (*reversible && p.l1_size > i_end)
+		i_end = p.l1_size;
+	for (i = 0; i < i_end; i++) {
+		if ((ret = load_l2_cluster(&c, i)))
+			goto err;
+		if (*reversible && (ret = load_l2_cluster(&p, i)))
+			goto err;
+
+		k_end = cluster / sizeof(__u32);
+		for (k = (i == 0) ? PLOOP_MAP_OFFSET : 0; k < k_end; k++) {
+			slot = i * k_end + k - PLOOP_MAP_OFFSET;
+			if (slot < c.l2_size && c.l2[k] != 0)
+				n_child++;
+			else if (*reversible && slot < p.l2_size && p.l2[k] != 0)
+				n_parent++;
+		}
+	}
+
+	*to_parent = (__u64)n_child * cluster;
+	*to_child = (__u64)n_parent * cluster;
+	ret = 0;
+err:
+	close_delta(&c);
+	close_delta(&p);
+
+	return ret;
+}
+
+static int merge_in_progress(const char *image)
+{
+	char fname[PATH_MAX];
+
+	MERGE_STATE_FNAME(fname, image);
+
+	return access(fname, F_OK) == 0;
+}
+
+/* Decide whether @parent should rather be merged into @child.
+ * An interrupted merge is always continued in its original direction.
+ */
+static int choose_merge_direction(const char *child, const char *parent,
+		struct ploop_merge_param *param)
+{
+	__u64 to_parent, to_child;
+	int reversible;
+
+	if (merge_in_progress(parent))
+		return 0;
+	if (merge_in_progress(child))
+		return 1;
+
+	if (estimate_merge_cost(child, parent, &to_parent, &to_child,
+				&reversible)) {
+		ploop_log(0, "Unable to estimate merge cost, merging into %s",
+				parent);
+		return 0;
+	}
+
+	ploop_log(0, "Merge estimate: %llu bytes into parent%s",
+			(unsigned long long)to_parent,
+			reversible ? "" : " (reverse merge is not possible)");
+	if (!reversible) {
+		param->moved_bytes += to_parent;
+		return 0;
+	}
+	ploop_log(0, "Merge estimate: %llu bytes into child",
+			(unsigned long long)to_child);
+
+	if (to_child < to_parent) {
+		param->moved_bytes += to_child;
+		return 1;
+	}
+	param->moved_bytes += to_parent;
+	return 0;
+}
+
+int ploop_merge_snapshot_by_guid(struct ploop_disk_images_data *di,
+		const char *guid, int merge_mode, struct ploop_merge_param *param)
 {
 	char conf[PATH_MAX];
 	char dev[64];
@@ -625,6 +939,7 @@ int ploop_merge_snapshot_by_guid(struct ploop_disk_images_data *di, const char *
 	int raw = (di->mode == PLOOP_RAW_MODE);
 	int online = 0;
 	int snap_idx;
+	int reverse = 0;
 	struct merge_info info = {};
 	int i, nelem;
 
@@ -744,12 +1059,43 @@ int ploop_merge_snapshot_by_guid(struct ploop_disk_images_data *di, const char *
 	}
 	names[2] = NULL;
 
+	/* A small child of a big parent is cheaper to be filled from
+	 * the parent, then it takes the parent's place.
+	 */
+	if (!online && param != NULL && param->choose_direction &&
+			di->mode == PLOOP_EXPANDED_MODE)
+		reverse = choose_merge_direction(names[0], names[1], param);
+
 	/* make validation before real merge */
 	ret = ploop_di_merge_image(di, child_guid, &delete_fname);
 	if (ret)
 		goto err;
 
-	ret = merge_image(device, start_level, end_level, raw, merge_top, names);
+	if (reverse) {
+		char *p;
+
+		for (i = 0; i < di->nimages; i++)
+			if (strcmp(di->images[i]->file, names[1]) == 0)
+				break;
+		if (i == di->nimages) {
+			ploop_err(0, "Can't find image %s", names[1]);
+			ret = SYSEXIT_PARAM;
+			goto err;
+		}
+		/* the child file takes the parent's place */
+		p = di->images[i]->file;
+		di->images[i]->file = delete_fname;
+		delete_fname = p;
+
+		ploop_log(0, "Merging %s into %s", names[1], names[0]);
+		p = names[0];
+		names[0] = names[1];
+		names[1] = p;
+		/* the child is written to, its checksums go stale */
+		drop_image_csum(names[1]);
+		ret = do_merge_image(NULL, 0, 1, 0, 0, names, MERGE_FILL_HOLES);
+	} else
+		ret = merge_image(device, start_level, end_level, raw, merge_top, names);
 	if (ret)
 		goto err;
 
@@ -762,6 +1108,7 @@ int ploop_merge_snapshot_by_guid(struct ploop_disk_images_data *di, const char *
 		ploop_err(errno, "unlink %s", delete_fname);
 		ret = SYSEXIT_UNLINK;
 	}
+	drop_image_csum(delete_fname);
 	if (ret == 0)
 		ploop_log(0, "ploop snapshot %s has been successfully merged",
 				guid);
@@ -784,16 +1131,20 @@ int ploop_merge_snapshot(struct ploop_disk_images_data *di, struct ploop_merge_p
 	if (ploop_lock_di(di))
 		return SYSEXIT_LOCK;
 
+	/* accumulated over all the merge steps */
+	param->moved_bytes = 0;
 	if (param->guid != NULL)
 		guid = param->guid;
 	else if (!param->merge_all)
 		guid = di->top_guid;
 
 	if (guid != NULL) {
-		ret = ploop_merge_snapshot_by_guid(di, guid, PLOOP_MERGE_WITH_PARENT);
+		ret = ploop_merge_snapshot_by_guid(di, guid,
+				PLOOP_MERGE_WITH_PARENT, param);
 	} else {
 		while (di->nsnapshots != 1) {
-			ret = ploop_merge_snapshot_by_guid(di, di->top_guid, PLOOP_MERGE_WITH_PARENT);
+			ret = ploop_merge_snapshot_by_guid(di, di->top_guid,
+					PLOOP_MERGE_WITH_PARENT, param);
 			if (ret)
 				break;
 		}
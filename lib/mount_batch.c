@@ -0,0 +1,314 @@
+/*
+ *  Copyright (C) 2008-2012, Parallels, Inc. All rights reserved.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/* Batch mount/umount.
+ *
+ * ploop_mount_image() locks the image, scans /sys/block to see if it is
+ * already in use and mounts it, one image at a time. For a node booting
+ * hundreds of containers the batch version locks all the images first,
+ * looks them all up in the device registry under one global lock and then
+ * runs the delta checks and mounts of the images on a pool of threads.
+ * Note every image holds its lock file open till it is processed.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <unistd.h>
+#include <limits.h>
+#include <string.h>
+#include <pthread.h>
+#include <linux/types.h>
+
+#include "ploop.h"
+
+#define MAX_BATCH_THREADS	32
+#define DEF_BATCH_THREADS	8
+
+struct batch_ctx {
+	struct ploop_batch_image *images;
+	char (*dev)[64];	/* umount: device of the image */
+	int *todo;
+	int n_todo;
+	int next;
+	int umount;
+	int stop;
+	pthread_t caller;
+	pthread_mutex_t lock;
+};
+
+static int mount_one(struct batch_ctx *ctx, int i)
+{
+	return mount_image(ctx->images[i].di, ctx->images[i].param, 0);
+}
+
+static int umount_one(struct batch_ctx *ctx, int i)
+{
+	int ret;
+
+	ret = ploop_complete_running_operation(ctx->dev[i]);
+	if (ret)
+		return ret;
+
+	return ploop_umount(ctx->dev[i], ctx->images[i].di);
+}
+
+static void *batch_worker(void *data)
+{
+	struct batch_ctx *ctx = data;
+	int caller = pthread_equal(pthread_self(), ctx->caller);
+	int i;
+
+	for (;;) {
+		/* ploop_cancel_operation() is seen by the thread that
+		 * started the batch only; it stops taking new images and the
+		 * other workers finish the ones they have
+		 */
+		pthread_mutex_lock(&ctx->lock);
+		if (caller && is_operation_cancelled())
+			ctx->stop = 1;
+		i = ctx->stop || ctx->next >= ctx->n_todo ?
+			-1 : ctx->todo[ctx->next++];
+		pthread_mutex_unlock(&ctx->lock);
+		if (i == -1)
+			break;
+
+		ctx->images[i].result = ctx->umount ?
+			umount_one(ctx, i) : mount_one(ctx, i);
+		if (ctx->images[i].result)
+			ploop_err(0, "Failed to %s %s: %d",
+					ctx->umount ? "unmount" : "mount",
+					ctx->images[i].di->images[0]->file,
+					ctx->images[i].result);
+		ploop_unlock_di(ctx->images[i].di);
+	}
+
+	return NULL;
+}
+
+static int run_workers(struct batch_ctx *ctx, int nthreads)
+{
+	pthread_t *threads;
+	int i, n, ret;
+
+	if (nthreads > ctx->n_todo)
+		nthreads = ctx->n_todo;
+	if (nthreads <= 0)
+		return 0;
+
+	threads = malloc(nthreads * sizeof(pthread_t));
+	if (threads == NULL) {
+		ploop_err(ENOMEM, "Memory allocation failed");
+		return SYSEXIT_MALLOC;
+	}
+
+	ctx->caller = pthread_self();
+	for (n = 0; n < nthreads - 1; n++) {
+		ret = pthread_create(&threads[n], NULL, batch_worker, ctx);
+		if (ret) {
+			ploop_err(ret, "Can't create thread");
+			break;
+		}
+	}
+
+	batch_worker(ctx);
+
+	for (i = 0; i < n; i++)
+		pthread_join(threads[i], NULL);
+	free(threads);
+
+	return 0;
+}
+
+/* Is image @i the same as one of the images before it? Two locks on
+ * the same descriptor from one process would wait for each other.
+ */
+static int is_dup_image(struct ploop_batch_image *images, char (*path)[PATH_MAX],
+		int i)
+{
+	const char *c1, *c2;
+	int j;
+
+	c1 = images[i].di->runtime->component_name;
+	for (j = 0; j < i; j++) {
+		if (images[j].di == NULL || strcmp(path[i], path[j]))
+			continue;
+		c2 = images[j].di->runtime->component_name;
+		if (!strcmp(c1 ? c1 : "", c2 ? c2 : ""))
+			return 1;
+	}
+
+	return 0;
+}
+
+static int batch_run(struct ploop_batch_image *images, int n,
+		struct ploop_batch_param *param, int umount)
+{
+	struct batch_ctx ctx = {};
+	char (*path)[PATH_MAX] = NULL;
+	const char *cn;
+	char **devs;
+	int *locked = NULL;
+	int i, nthreads, lckfd, ret;
+
+	if (n <= 0)
+		return 0;
+
+	nthreads = param && param->threads ? param->threads : DEF_BATCH_THREADS;
+	if (nthreads > MAX_BATCH_THREADS)
+		nthreads = MAX_BATCH_THREADS;
+
+	pthread_mutex_init(&ctx.lock, NULL);
+	path = malloc(n * sizeof(*path));
+	locked = calloc(n, sizeof(int));
+	ctx.todo = malloc(n * sizeof(int));
+	ctx.dev = calloc(n, sizeof(*ctx.dev));
+	if (path == NULL || locked == NULL || ctx.todo == NULL ||
+			ctx.dev == NULL) {
+		ploop_err(ENOMEM, "Memory allocation failed");
+		ret = SYSEXIT_MALLOC;
+		goto err;
+	}
+	ctx.images = images;
+	ctx.umount = umount;
+
+	/* Lock all the images first, so the device table read below
+	 * stays valid for them until they are processed.
+	 */
+	for (i = 0; i < n; i++) {
+		struct ploop_disk_images_data *di = images[i].di;
+
+		images[i].result = 0;
+		if (di == NULL || di->nimages <= 0) {
+			ploop_err(0, "No images specified");
+			images[i].result = SYSEXIT_PARAM;
+			continue;
+		}
+
+		if (!umount && images[i].param == NULL) {
+			ploop_err(0, "No mount parameters for %s",
+					di->images[0]->file);
+			images[i].result = SYSEXIT_PARAM;
+			continue;
+		}
+
+		if (realpath(di->images[0]->file, path[i]) == NULL) {
+			ploop_err(errno, "Can't resolve %s", di->images[0]->file);
+			images[i].result = SYSEXIT_PARAM;
+			continue;
+		}
+
+		if (is_dup_image(images, path, i)) {
+			ploop_err(0, "Image %s is given more than once",
+					di->images[0]->file);
+			images[i].result = SYSEXIT_PARAM;
+			continue;
+		}
+
+		if (ploop_lock_di(di)) {
+			images[i].result = SYSEXIT_LOCK;
+			continue;
+		}
+		locked[i] = 1;
+	}
+
+	lckfd = ploop_global_lock();
+	if (lckfd == -1) {
+		ret = SYSEXIT_LOCK;
+		goto err;
+	}
+
+	for (i = 0; i < n; i++) {
+		if (!locked[i])
+			continue;
+
+		/* the same lookup as ploop_find_dev() does */
+		cn = images[i].di->runtime->component_name;
+		ret = devreg_get_dev(cn ? cn : "", path[i], &devs);
+		if (ret == -1) {
+			images[i].result = SYSEXIT_SYS;
+		} else if (!umount && ret == 0) {
+			ploop_err(0, "Image %s already used by device %s",
+					images[i].di->images[0]->file, devs[0]);
+			images[i].result = SYSEXIT_MOUNT;
+		} else if (umount && ret == 1) {
+			ploop_err(0, "Image %s is not mounted",
+					images[i].di->images[0]->file);
+			images[i].result = SYSEXIT_DEV_NOT_MOUNTED;
+		} else if (umount)
+			snprintf(ctx.dev[i], sizeof(ctx.dev[i]), "%s", devs[0]);
+		ploop_free_array(devs);
+
+		if (images[i].result) {
+			ploop_unlock_di(images[i].di);
+			locked[i] = 0;
+			continue;
+		}
+
+		ctx.todo[ctx.n_todo++] = i;
+	}
+	/* the device set was checked at most once for the whole batch */
+	devreg_unlock(lckfd);
+
+	ploop_log(0, "%s %d of %d images using %d threads",
+			umount ? "Unmounting" : "Mounting", ctx.n_todo, n,
+			nthreads < ctx.n_todo ? nthreads : ctx.n_todo);
+
+	/* the workers unlock the images they have processed */
+	ret = run_workers(&ctx, nthreads);
+	for (i = 0; i < ctx.n_todo; i++)
+		locked[ctx.todo[i]] = 0;
+	for (i = ctx.next; i < ctx.n_todo; i++) {
+		images[ctx.todo[i]].result = ret ? ret : SYSEXIT_ABORT;
+		ploop_unlock_di(images[ctx.todo[i]].di);
+	}
+
+	if (ret == 0)
+		for (i = 0; i < n; i++)
+			if (images[i].result) {
+				ret = images[i].result;
+				break;
+			}
+
+err:
+	if (locked)
+		for (i = 0; i < n; i++)
+			if (locked[i]) {
+				images[i].result = ret;
+				ploop_unlock_di(images[i].di);
+			}
+	pthread_mutex_destroy(&ctx.lock);
+	free(ctx.dev);
+	free(ctx.todo);
+	free(locked);
+	free(path);
+
+	return ret;
+}
+
+int ploop_mount_images(struct ploop_batch_image *images, int n,
+		struct ploop_batch_param *param)
+{
+	return batch_run(images, n, param, 0);
+}
+
+int ploop_umount_images(struct ploop_batch_image *images, int n,
+		struct ploop_batch_param *param)
+{
+	return batch_run(images, n, param, 1);
+}
@@ -32,6 +32,10 @@
 #include <fcntl.h>
 #include <sys/vfs.h>
 #include <sys/syscall.h>
+#include <sys/socket.h>
+#include <linux/netlink.h>
+#include <poll.h>
+#include <time.h>
 #include <mntent.h>
 #include <ext2fs/ext2_fs.h>
 
@@ -55,7 +59,7 @@ static off_t round_bdsize(off_t size, __u32 blocksize, int version)
 /* set cancel flag
  * Note: this function also clear the flag
  */
-static int is_operation_cancelled(void)
+int is_operation_cancelled(void)
 {
 	struct ploop_cancel_handle *cancel_data;
 
@@ -88,6 +92,13 @@ int sys_syncfs(int fd)
 	return syscall(__NR_syncfs, fd);
 }
 
+ssize_t sys_copy_file_range(int fd_in, off_t *off_in, int fd_out,
+		off_t *off_out, size_t len, unsigned int flags)
+{
+	return syscall(__NR_copy_file_range, fd_in, off_in, fd_out, off_out,
+			len, flags);
+}
+
 int get_list_size(char **list)
 {
 	int i;
@@ -96,7 +107,7 @@ int get_list_size(char **list)
 	return i;
 }
 
-static char **make_images_list(struct ploop_disk_images_data *di, const char *guid, int reverse)
+char **make_images_list(struct ploop_disk_images_data *di, const char *guid, int reverse)
 {
 	int n;
 	char **images;
@@ -307,7 +318,7 @@ int check_blockdev_size(unsigned long long sectors, __u32 blocksize, int version
 	return 0;
 }
 
-static int create_empty_delta(const char *path, __u32 blocksize, off_t bdsize,
+int create_empty_delta(const char *path, __u32 blocksize, off_t bdsize,
 		int version)
 {
 	int fd;
@@ -351,12 +362,17 @@ static int create_empty_delta(const char *path, __u32 blocksize, off_t bdsize,
 	if (WRITE(fd, buf, cluster))
 		goto out_close;
 
-	if (SizeToFill > cluster) {
-		int i;
-		memset(buf, 0, cluster);
-		for (i = 1; i < SizeToFill / cluster; i++)
-			if (WRITE(fd, buf, cluster))
-				goto out_close;
+	/* The rest of the index is all zeroes, so do not write it: have
+	 * the file system allocate it zeroed (or leave a hole), which takes
+	 * the same time whatever the disk size. The file size still ends at
+	 * m_FirstBlockOffset, where the kernel puts the first data cluster.
+	 */
+	if (SizeToFill > cluster &&
+			sys_fallocate(fd, 0, cluster, SizeToFill - cluster)) {
+		if (errno != ENOTSUP || ftruncate(fd, SizeToFill)) {
+			ploop_err(errno, "Failed to allocate index of %s", path);
+			goto out_close;
+		}
 	}
 
 	if (fsync(fd)) {
@@ -689,6 +705,7 @@ static int ploop_drop_image(struct ploop_disk_images_data *di)
 	for (i = 0; i < di->nimages; i++) {
 		ploop_log(1, "Dropping image %s", di->images[i]->file);
 		unlink(di->images[i]->file);
+		drop_image_csum(di->images[i]->file);
 	}
 
 	get_temp_mountpoint(di->images[0]->file, 0, fname, sizeof(fname));
@@ -773,17 +790,101 @@ int ploop_getdevice(int *minor)
 	return fd;
 }
 
-/* Workaround for bug #PCLIN-30116 */
+#define IOCTL_WAIT_MIN_NS	100000ULL	/* first retry after 100us */
+#define IOCTL_WAIT_MAX_NS	200000000ULL
+#define IOCTL_WAIT_TIMEOUT	60		/* seconds */
+
+/* Kernel and udev uevents, to retry as soon as udev is done with
+ * the device; -1 if not available.
+ */
+static int open_uevent_socket(void)
+{
+	struct sockaddr_nl sa = {
+		.nl_family = AF_NETLINK,
+		.nl_groups = 1 | 2,	/* kernel | udev */
+	};
+	int fd;
+
+	fd = socket(AF_NETLINK, SOCK_DGRAM | SOCK_CLOEXEC | SOCK_NONBLOCK,
+			NETLINK_KOBJECT_UEVENT);
+	if (fd == -1)
+		return -1;
+	if (bind(fd, (struct sockaddr *)&sa, sizeof(sa))) {
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+static __u64 now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* Wait up to @ns, or till an uevent comes */
+static void wait_uevent(int fd, __u64 ns)
+{
+	struct timespec ts = {
+		.tv_sec = ns / 1000000000ULL,
+		.tv_nsec = ns % 1000000000ULL,
+	};
+	struct pollfd pfd = { .fd = fd, .events = POLLIN };
+	char buf[4096];
+
+	if (fd == -1) {
+		nanosleep(&ts, NULL);
+		return;
+	}
+
+	if (ppoll(&pfd, 1, &ts, NULL) > 0)
+		while (recv(fd, buf, sizeof(buf), 0) > 0)
+			;
+}
+
+/* Workaround for bug #PCLIN-30116: the device can be busy for a while
+ * (e.g. udev is probing it), retry with an exponential backoff.
+ */
 static int do_ioctl(int fd, int req)
 {
-	int i, ret;
+	int ret, ev = -1;
+	__u64 start = 0, deadline = 0, delay = IOCTL_WAIT_MIN_NS, now;
 
-	for (i = 0; i < 60; i++) {
+	for (;;) {
 		ret = ioctl(fd, req, 0);
 		if (ret == 0 || (ret == -1 && errno != EBUSY))
-			return ret;
-		sleep(1);
+			break;
+
+		now = now_ns();
+		if (start == 0) {
+			start = now;
+			deadline = now + IOCTL_WAIT_TIMEOUT * 1000000000ULL;
+			ev = open_uevent_socket();
+		}
+		if (now >= deadline) {
+			errno = EBUSY;
+			break;
+		}
+
+		wait_uevent(ev, delay < deadline - now ? delay : deadline - now);
+		delay *= 2;
+		if (delay > IOCTL_WAIT_MAX_NS)
+			delay = IOCTL_WAIT_MAX_NS;
 	}
+
+	if (start) {
+		int err = errno;
+
+		ploop_log(ret ? 0 : 1, "Device was busy, waited %.3f sec",
+				(now_ns() - start) / 1e9);
+		if (ev != -1)
+			close(ev);
+		errno = err;
+	}
+
 	return ret;
 }
 
@@ -903,6 +1004,7 @@ static int ploop_stop(int fd, const char *devname)
 		ploop_err(errno, "PLOOP_IOC_CLEAR");
 		return SYSEXIT_DEVIOC;
 	}
+	devreg_del(devname);
 	return 0;
 }
 
@@ -1230,24 +1332,32 @@ static int create_ploop_dev(int minor)
 	return 0;
 }
 
-/* NB: caller will take care about *lfd_p even if we fail */
+/* NB: caller will take care about *lfd_p even if we fail.
+ * If @pool is given, the deltas are being checked in background:
+ * every delta is added as soon as its check is complete, and the pool
+ * is released here.
+ */
 static int add_deltas(struct ploop_disk_images_data *di,
 		char **images, struct ploop_mount_param *param,
-		int raw, __u32 blocksize, int *lfd_p)
+		int raw, __u32 blocksize, int *lfd_p,
+		struct delta_check_pool *pool)
 {
 	int lckfd = -1;
 	char *device = param->device;
 	int i;
 	int ret = 0;
 	struct ploop_ctl_delta req = {};
+	__u64 prefetch;
 
 	if (device[0] == '\0') {
 		char buf[64];
 		int minor;
 
 		lckfd = ploop_getdevice(&minor);
-		if (lckfd == -1)
-			return SYSEXIT_DEVICE;
+		if (lckfd == -1) {
+			ret = SYSEXIT_DEVICE;
+			goto err;
+		}
 
 		snprintf(device, sizeof(param->device), "/dev/%s",
 				make_sysfs_dev_name(minor, buf, sizeof(buf)));
@@ -1275,6 +1385,10 @@ static int add_deltas(struct ploop_disk_images_data *di,
 	req.f.pctl_fd = -1;
 	req.f.pctl_type = PLOOP_IO_AUTO;
 
+	prefetch = param->prefetch;
+	if (prefetch)
+		prefetch_deltas(images, raw, &prefetch);
+
 	for (i = 0; images[i] != NULL; i++) {
 		int ro = (images[i+1] != NULL || param->ro) ? 1: 0;
 		char *image = images[i];
@@ -1287,17 +1401,48 @@ static int add_deltas(struct ploop_disk_images_data *di,
 		else
 			req.c.pctl_flags &= ~PLOOP_FMT_RDONLY;
 
+		if (pool != NULL) {
+			__u32 bs;
+
+			if ((ret = check_deltas_wait(pool, i, &bs)))
+				goto err1;
+			if (bs != blocksize) {
+				ploop_err(0, "Incorrect blocksize %s bs=%d [current bs=%d]",
+						image, blocksize, bs);
+				ret = SYSEXIT_PARAM;
+				goto err1;
+			}
+		}
+
+		if (!ro && !(raw && i == 0)) {
+			ret = param->alloc_journal ?
+				alloc_journal_checkpoint(image, blocksize) :
+				alloc_journal_drop(image);
+			if (ret)
+				goto err1;
+		}
+
 		ploop_log(0, "Adding delta dev=%s img=%s (%s)",
 				device, image, ro ? "ro" : "rw");
 		ret = add_delta(*lfd_p, image, &req);
 		if (ret)
 			goto err1;
 	}
+	if (pool != NULL) {
+		ret = check_deltas_finish(pool, &blocksize);
+		pool = NULL;
+		if (ret)
+			goto err1;
+	}
 	if (ioctl(*lfd_p, PLOOP_IOC_START, 0) < 0) {
 		ploop_err(errno, "PLOOP_IOC_START");
 		ret = SYSEXIT_DEVIOC;
 		goto err1;
 	}
+	devreg_add(device);
+	if (prefetch)
+		prefetch_device(device, blocksize, prefetch,
+				param->prefetch_list);
 
 err1:
 	if (ret) {
@@ -1315,6 +1460,8 @@ err1:
 			ploop_err(errno, "PLOOP_IOC_CLEAR");
 	}
 err:
+	if (pool != NULL)
+		check_deltas_finish(pool, &blocksize);
 	if (lckfd != -1)
 		close(lckfd);
 	return ret;
@@ -1370,6 +1517,7 @@ int ploop_mount(struct ploop_disk_images_data *di, char **images,
 	struct stat st;
 	int ret = 0;
 	__u32 blocksize = 0;
+	struct delta_check_pool *pool = NULL;
 
 	if (images == NULL || images[0] == NULL) {
 		ploop_err(0, "ploop_mount: no deltas to mount");
@@ -1405,11 +1553,18 @@ int ploop_mount(struct ploop_disk_images_data *di, char **images,
 	if (di && (ret = check_and_restore_fmt_version(di)))
 		goto err;
 
-	ret = check_deltas(di, images, param, raw, &blocksize);
-	if (ret)
-		goto err;
+	if (blocksize != 0) {
+		/* Let deltas be added while the upper ones are checked */
+		ret = check_deltas_start(di, images, param, raw, blocksize, &pool);
+		if (ret)
+			goto err;
+	} else {
+		ret = check_deltas(di, images, param, raw, &blocksize);
+		if (ret)
+			goto err;
+	}
 
-	ret = add_deltas(di, images, param, raw, blocksize, &lfd);
+	ret = add_deltas(di, images, param, raw, blocksize, &lfd, pool);
 	if (ret)
 		goto err;
 
@@ -1434,7 +1589,7 @@ err:
 	return ret;
 }
 
-static int mount_image(struct ploop_disk_images_data *di, struct ploop_mount_param *param, int flags)
+int mount_image(struct ploop_disk_images_data *di, struct ploop_mount_param *param, int flags)
 {
 	int ret;
 	char **images;
@@ -1524,6 +1679,7 @@ int ploop_mount_snapshot(struct ploop_disk_images_data *di, struct ploop_mount_p
 static int ploop_stop_device(const char *device)
 {
 	int lfd, ret;
+	char image[PATH_MAX] = "";
 
 	ploop_log(0, "Unmounting device %s", device);
 	lfd = open(device, O_RDONLY);
@@ -1532,9 +1688,15 @@ static int ploop_stop_device(const char *device)
 		return SYSEXIT_DEVICE;
 	}
 
+	ploop_find_top_delta_name_and_format(device, image, sizeof(image),
+			NULL, 0);
 	ret = ploop_stop(lfd, device);
 	close(lfd);
 
+	/* the image is clean now, the journal is not needed */
+	if (ret == 0 && image[0] != '\0')
+		alloc_journal_drop(image);
+
 	return ret;
 }
 
@@ -1666,7 +1828,7 @@ static int get_image_param_offline(struct ploop_disk_images_data *di, const char
 	return 0;
 }
 
-static int get_image_param(struct ploop_disk_images_data *di, const char *guid,
+int get_image_param(struct ploop_disk_images_data *di, const char *guid,
 		off_t *size, __u32 *blocksize, int *version)
 {
 	int ret;
@@ -1754,6 +1916,9 @@ int ploop_grow_image(struct ploop_disk_images_data *di, off_t size)
 	if (ploop_lock_di(di))
 		return SYSEXIT_LOCK;
 
+	/* pooled deltas are of the old size */
+	delta_pool_drop(di->images[0]->file);
+
 	ret = ploop_find_dev_by_uuid(di, 1, device, sizeof(device));
 	if (ret == -1) {
 		ret = SYSEXIT_SYS;
@@ -1913,6 +2078,9 @@ int ploop_resize_image(struct ploop_disk_images_data *di, struct ploop_resize_pa
 	if (ploop_lock_di(di))
 		return SYSEXIT_LOCK;
 
+	/* pooled deltas are of the old size */
+	delta_pool_drop(di->images[0]->file);
+
 	ret = ploop_find_dev_by_uuid(di, 1, buf, sizeof(buf));
 	if (ret == -1) {
 		ret = SYSEXIT_SYS;
@@ -1993,8 +2161,9 @@ int ploop_resize_image(struct ploop_disk_images_data *di, struct ploop_resize_pa
 
 		new_balloon_size = balloon_size + B2S(fs.f_bfree * fs.f_bsize);
 		new_balloon_size -= B2S(delta);
-		ret = ploop_balloon_change_size(mount_param.device,
-				balloonfd, new_balloon_size);
+		ret = balloon_change_size(mount_param.device,
+				balloonfd, new_balloon_size,
+				param->balloon_step, param->balloon_rate);
 	} else if (new_size > dev_size) {
 		char conf[PATH_MAX];
 		char conf_tmp[PATH_MAX];
@@ -2103,8 +2272,10 @@ int ploop_resize_image(struct ploop_disk_images_data *di, struct ploop_resize_pa
 			}
 
 			if (new_balloon_size != balloon_size) {
-				ret = ploop_balloon_change_size(mount_param.device,
-						balloonfd, new_balloon_size);
+				ret = balloon_change_size(mount_param.device,
+						balloonfd, new_balloon_size,
+						param->balloon_step,
+						param->balloon_rate);
 				if (ret)
 					goto err;
 				tune_fs(mount_param.target, part_device, new_fs_size);
@@ -2175,15 +2346,16 @@ static int expanded2raw(struct ploop_disk_images_data *di)
 			goto err;
 		}
 		if (delta.l2[l2_slot] != 0) {
-			if (PREAD(&delta, buf, cluster, S2B(ploop_ioff_to_sec(delta.l2[l2_slot],
-								delta.blocksize, delta.version))))
+			if (copy_delta_block(&delta, S2B(ploop_ioff_to_sec(delta.l2[l2_slot],
+							delta.blocksize, delta.version)),
+						&odelta, (off_t)clu * cluster, cluster,
+						buf, CB_NOFLAGS))
 				goto err;
 		} else {
 			bzero(buf, cluster);
+			if (PWRITE(&odelta, buf, cluster, (off_t)clu * cluster))
+				goto err;
 		}
-
-		if (PWRITE(&odelta, buf, cluster, clu * cluster))
-			goto err;
 	}
 
 	if (fsync(odelta.fd))
@@ -2769,7 +2941,8 @@ static int do_snapshot(int lfd, int fd, struct ploop_ctl_delta *req)
 	return 0;
 }
 
-int create_snapshot(const char *device, const char *delta, int syncfs)
+static int do_create_snapshot(const char *device, const char *delta,
+		int syncfs, const char *pool)
 {
 	int ret;
 	int lfd = -1;
@@ -2794,7 +2967,11 @@ int create_snapshot(const char *device, const char *delta, int syncfs)
 		return SYSEXIT_DEVICE;
 	}
 
-	fd = create_empty_delta(delta, blocksize, bdsize, version);
+	fd = -1;
+	if (pool != NULL)
+		fd = delta_pool_claim(pool, delta, blocksize, bdsize, version);
+	if (fd < 0)
+		fd = create_empty_delta(delta, blocksize, bdsize, version);
 	if (fd < 0) {
 		ret = SYSEXIT_OPEN;
 		goto err;
@@ -2822,6 +2999,11 @@ err:
 	return ret;
 }
 
+int create_snapshot(const char *device, const char *delta, int syncfs)
+{
+	return do_create_snapshot(device, delta, syncfs, NULL);
+}
+
 int ploop_get_spec(struct ploop_disk_images_data *di, struct ploop_spec *spec)
 {
 	int ret;
@@ -2848,6 +3030,7 @@ int ploop_create_snapshot(struct ploop_disk_images_data *di, struct ploop_snapsh
 	char conf[PATH_MAX];
 	char conf_tmp[PATH_MAX];
 	int online = 0;
+	int refill = 0;
 	int n;
 	off_t size;
 	__u32 blocksize;
@@ -2861,6 +3044,11 @@ int ploop_create_snapshot(struct ploop_disk_images_data *di, struct ploop_snapsh
 		ploop_err(0, "Incorrect guid %s", param->guid);
 		return SYSEXIT_PARAM;
 	}
+	if (param->pool < 0 || param->pool > DELTA_POOL_MAX) {
+		ploop_err(0, "Incorrect pool size %d, the maximum is %d",
+				param->pool, DELTA_POOL_MAX);
+		return SYSEXIT_PARAM;
+	}
 
 	if (ploop_lock_di(di))
 		return SYSEXIT_LOCK;
@@ -2923,7 +3111,10 @@ int ploop_create_snapshot(struct ploop_disk_images_data *di, struct ploop_snapsh
 		if (ret)
 			goto err_cleanup2;
 
-		fd = create_empty_delta(fname, blocksize, size, version);
+		fd = delta_pool_claim(di->images[0]->file, fname,
+				blocksize, size, version);
+		if (fd < 0)
+			fd = create_empty_delta(fname, blocksize, size, version);
 		if (fd < 0) {
 			ret = SYSEXIT_CREAT;
 			goto err_cleanup2;
@@ -2931,7 +3122,7 @@ int ploop_create_snapshot(struct ploop_disk_images_data *di, struct ploop_snapsh
 		close(fd);
 	} else {
 		// Always sync fs
-		ret = create_snapshot(dev, fname, 1);
+		ret = do_create_snapshot(dev, fname, 1, di->images[0]->file);
 		if (ret)
 			goto err_cleanup2;
 	}
@@ -2948,6 +3139,11 @@ int ploop_create_snapshot(struct ploop_disk_images_data *di, struct ploop_snapsh
 
 	ploop_log(0, "ploop snapshot %s has been successfully created",
 			snap_guid);
+
+	/* replace the pooled delta we may have used */
+	if (ret == 0 && param->pool > 0 && get_image_param(di, di->top_guid,
+				&size, &blocksize, &version) == 0)
+		refill = 1;
 err_cleanup2:
 	if (ret && !online && unlink(conf_tmp))
 		ploop_err(errno, "Can't unlink %s", conf_tmp);
@@ -2955,6 +3151,11 @@ err_cleanup2:
 err_cleanup1:
 	ploop_unlock_di(di);
 
+	/* not under the lock, the pool deltas are not in use yet */
+	if (refill)
+		delta_pool_fill(di->images[0]->file, param->pool,
+				blocksize, size, version);
+
 	return ret;
 }
 
@@ -3172,7 +3373,7 @@ int ploop_delete_snapshot(struct ploop_disk_images_data *di, const char *guid)
 			ploop_log(0, "ploop snapshot %s has been successfully deleted",
 				guid);
 	} else if (nelem == 1) {
-		ret = ploop_merge_snapshot_by_guid(di, guid, PLOOP_MERGE_WITH_CHILD);
+		ret = ploop_merge_snapshot_by_guid(di, guid, PLOOP_MERGE_WITH_CHILD, NULL);
 	} else {
 		/* There no functionality to merge snapshot with >1 child */
 		ret = SYSEXIT_PARAM;
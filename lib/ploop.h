@@ -34,6 +34,16 @@
 #endif
 #endif /* ! __NR_syncfs */
 
+#ifndef __NR_copy_file_range
+#if defined __i386__
+#define __NR_copy_file_range	377
+#elif defined __x86_64__
+#define __NR_copy_file_range	326
+#else
+#error "No copy_file_range syscall known for this arch"
+#endif
+#endif /* ! __NR_copy_file_range */
+
 /* from linux/magic.h */
 #ifndef EXT4_SUPER_MAGIC
 #define EXT4_SUPER_MAGIC	0xEF53
@@ -45,12 +55,17 @@
 #define NONE_UUID		"{00000000-0000-0000-0000-000000000000}"
 #define DEFAULT_FSTYPE		"ext4"
 #define BALLOON_FNAME		".balloon-c3a5ae3d-ce7f-43c4-a1ea-c61e2b4504e8"
+#define PLOOP_LOCK_DIR		"/var/lock/ploop"
 
 /* od_flags for open_delta() */
 #define OD_NOFLAGS	0x0
 #define OD_ALLOW_DIRTY	0x1
 #define OD_OFFLINE	0x2
 
+/* flags for copy_delta_block() */
+#define CB_NOFLAGS	0x0
+#define CB_BUFFERED	0x1	/* never remap blocks, image is used by kernel */
+
 /* flags for ploop_check() */
 #define CHECK_FORCE	0x01
 #define CHECK_HARDFORCE	0x02
@@ -83,6 +98,8 @@ struct delta_fops
 	int		(*fstat)(int fd, struct stat *buf);
 	int		(*fsync)(int fd);
 	int		(*update_size)(int fd, const char *pathname);
+	int		(*copy_range)(int fd_in, off_t off_in, int fd_out,
+				off_t off_out, size_t count);
 };
 
 struct delta
@@ -155,6 +172,25 @@ struct relocmap {
 	struct ploop_reloc_cluster_extent extents[0];
 };
 
+/* Reverse map iblk -> clu, a two-level sparse array. Chunks are
+ * allocated on first store, absent chunks read as PLOOP_ZERO_INDEX.
+ */
+#define RMAP_CHUNK_BITS		12
+#define RMAP_CHUNK_SIZE		(1U << RMAP_CHUNK_BITS)
+
+struct rmap {
+	__u32 len;		/* number of iblk entries */
+	__u32 n_chunks;
+	__u32 **chunks;
+};
+
+static inline __u32 rmap_get(struct rmap *rmap, __u32 iblk)
+{
+	__u32 *chunk = rmap->chunks[iblk >> RMAP_CHUNK_BITS];
+
+	return chunk ? chunk[iblk & (RMAP_CHUNK_SIZE - 1)] : PLOOP_ZERO_INDEX;
+}
+
 struct merge_info {
 	int start_level;
 	int end_level;
@@ -172,10 +208,13 @@ struct xfer_desc
 	__u64	pos;
 };
 
+struct di_index;
+
 struct ploop_disk_images_runtime_data {
 	int lckfd;
 	char *xml_fname;
 	char *component_name;
+	struct di_index *index;	/* guid lookups, built on demand */
 };
 
 struct dump2fs_data {
@@ -242,6 +281,8 @@ int extend_delta_array(struct delta_array * p, char * path, int rw, int od_flags
 void close_delta(struct delta *delta);
 int open_delta(struct delta * delta, const char * path, int rw, int od_flags);
 int open_delta_simple(struct delta * delta, const char * path, int rw, int od_flags);
+int copy_delta_block(struct delta *src, off_t src_off, struct delta *dst,
+		off_t dst_off, unsigned int size, void *buf, int flags);
 int change_delta_version(struct delta *delta, int version);
 int change_delta_flags(struct delta * delta, __u32 flags);
 int dirty_delta(struct delta * delta);
@@ -258,10 +299,13 @@ PL_EXT int ploop_grow_delta_offline(const char *image, off_t new_size);
 struct pfiemap *fiemap_alloc(int n);
 int fiemap_get(int fd, __u64 off, __u64 start, off_t size, struct pfiemap **pfiemap_pp);
 void fiemap_adjust(struct pfiemap *pfiemap, __u32 blocksize);
-int fiemap_build_rmap(struct pfiemap *pfiemap, __u32 *rmap, __u32 rlen, struct delta *delta);
+int fiemap_build_rmap(struct pfiemap *pfiemap, struct rmap *rmap, struct delta *delta);
 
+struct rmap *rmap_alloc(__u32 len);
+void rmap_free(struct rmap *rmap);
+int rmap_set(struct rmap *rmap, __u32 iblk, __u32 clu);
 struct freemap *freemap_alloc(int n);
-int rmap2freemap(__u32 *rmap, __u32 iblk_start, __u32 iblk_end,
+int rmap2freemap(struct rmap *rmap, __u32 iblk_start, __u32 iblk_end,
 		 struct freemap **freemap_pp, int *entries_used);
 struct ploop_freeblks_ctl;
 int freeblks_alloc(struct ploop_freeblks_ctl **freeblks_pp, int n);
@@ -271,7 +315,21 @@ int freeblks2freemap(struct ploop_freeblks_ctl *freeblks,
 		struct freemap **freemap_pp, __u32 *total);
 
 int range_build(__u32 a_h, __u32 n_free_blocks,
-		__u32 *rmap, __u32 rlen,
+		struct rmap *rmap,
+		struct delta     *delta,
+		struct freemap   *freemap,
+		struct freemap  **rangemap_pp,
+		struct relocmap **relocmap_pp);
+
+struct reloc_index {
+	struct rmap *rmap;	/* iblk -> clu for [start, end) */
+	__u32 start;
+	__u32 end;
+};
+void reloc_index_free(struct reloc_index *idx);
+int range_build_indexed(struct reloc_index **idx_p,
+		__u32 a_h, __u32 n_free_blocks,
+		struct rmap *rmap,
 		struct delta     *delta,
 		struct freemap   *freemap,
 		struct freemap  **rangemap_pp,
@@ -281,11 +339,44 @@ struct relocmap *relocmap_alloc(int n);
 struct ploop_relocblks_ctl;
 int relocmap2relocblks(struct relocmap *relocmap, int lvl, __u32 a_h, __u32 n_scanned,
 			struct ploop_relocblks_ctl **relocblks_pp);
+int reloc_index_update(struct reloc_index *idx, struct relocmap *relocmap,
+		__u32 new_a_h, struct delta *delta);
 PL_EXT int ploop_check(char *img, int flags, int ro, int raw, int verbose,
 		__u32 *blocksize_p);
 int check_deltas(struct ploop_disk_images_data *di, char **images,
                 struct ploop_mount_param *param, int raw, __u32 *blocksize);
+struct delta_check_pool;
+int check_deltas_start(struct ploop_disk_images_data *di, char **images,
+		struct ploop_mount_param *param, int raw, __u32 blocksize,
+		struct delta_check_pool **out);
+int check_deltas_wait(struct delta_check_pool *pool, int idx, __u32 *blocksize);
+int check_deltas_finish(struct delta_check_pool *pool, __u32 *blocksize);
 int ploop_check_delta(const char *image, int fd, __u64 blocksize);
+
+/* Allocation journal */
+#define ALLOC_JOURNAL_MAX_RANGES	1024
+struct alloc_journal_range {
+	__u32 iblk;
+	__u32 len;
+};
+
+struct alloc_journal {
+	__u32 magic;
+	__u32 blocksize;
+	__u32 generation;	/* bumped on every checkpoint */
+	__u32 alloc_head;	/* image size in clusters at checkpoint */
+	__u64 ino;		/* inode of the image */
+	__u32 nr_ranges;
+	__u32 csum;
+	struct alloc_journal_range ranges[ALLOC_JOURNAL_MAX_RANGES];
+};
+
+int alloc_journal_read(const char *image, struct alloc_journal **aj_p);
+int alloc_journal_checkpoint(const char *image, __u32 blocksize);
+int alloc_journal_drop(const char *image);
+int alloc_journal_drop_dev(const char *device);
+int alloc_journal_add_freeblks(const char *device,
+		struct ploop_freeblks_ctl *freeblks);
 /* Logging */
 #define LOG_BUF_SIZE	8192
 int ploop_get_log_level(void);
@@ -318,6 +409,7 @@ PL_EXT int ploop_mount(struct ploop_disk_images_data *di, char **images,
 		struct ploop_mount_param *param, int raw);
 PL_EXT int create_snapshot(const char *device, const char *delta, int syncfs);
 int get_list_size(char **list);
+char **make_images_list(struct ploop_disk_images_data *di, const char *guid, int reverse);
 void free_images_list(char **images);
 int PWRITE(struct delta * delta, void * buf, unsigned int size, off_t off);
 int PREAD(struct delta * delta, void *buf, unsigned int size, off_t off);
@@ -329,6 +421,9 @@ int find_image_idx_by_guid(struct ploop_disk_images_data *di, const char *guid);
 int ploop_find_dev_by_uuid(struct ploop_disk_images_data *di, int check_state, char *out, int len);
 int sys_fallocate(int fd, int mode, off_t offset, off_t len);
 int sys_syncfs(int fd);
+ssize_t sys_copy_file_range(int fd_in, off_t *off_in, int fd_out,
+		off_t *off_out, size_t len, unsigned int flags);
+int is_operation_cancelled(void);
 
 // manage struct ploop_disk_images_data
 int ploop_di_add_image(struct ploop_disk_images_data *di, const char *fname,
@@ -348,16 +443,43 @@ int ploop_find_dev(const char *module, const char *image, char *out, int size);
 PL_EXT char *mntn2str(int mntn_type);
 PL_EXT int get_balloon(const char *mount_point, struct stat *st, int *outfd);
 PL_EXT int ploop_balloon_change_size(const char *device, int balloonfd, off_t new_size);
+int balloon_change_size(const char *device, int balloonfd, off_t new_size,
+		__u64 step, __u64 rate);
 PL_EXT int ploop_balloon_get_state(const char *device, __u32 *state);
 PL_EXT int ploop_balloon_clear_state(const char *device);
 PL_EXT int ploop_balloon_complete(const char *device);
 PL_EXT int ploop_balloon_check_and_repair(const char *device, const char *mount_point, int repair);
 PL_EXT int ploop_discard_get_stat_by_dev(const char *device, const char *mount_point,
 		struct ploop_discard_stat *pd_stat);
+PL_EXT int ploop_discard_get_stat_ex_by_dev(const char *device,
+		const char *mount_point, struct ploop_discard_stat_ex *pd_stat);
 PL_EXT int ploop_discard_by_dev(const char *device, const char *mount_point,
 		__u64 minlen_b, __u64 to_free, const int *stop);
 int ploop_blk_discard(const char* device, __u32 blocksize, off_t start, off_t end);
 
+/* prefetch */
+void prefetch_deltas(char **images, int raw, __u64 *budget);
+void prefetch_device(const char *device, __u32 blocksize, __u64 budget,
+		const char *list);
+
+/* delta pool, see delta_pool.c */
+int create_empty_delta(const char *path, __u32 blocksize, off_t bdsize,
+		int version);
+#define DELTA_POOL_MAX	16
+int delta_pool_claim(const char *base, const char *path, __u32 blocksize,
+		off_t bdsize, int version);
+int delta_pool_fill(const char *base, int count, __u32 blocksize,
+		off_t bdsize, int version);
+void delta_pool_drop(const char *base);
+
+/* device registry, see devreg.c */
+int devreg_get_dev(const char *component_name, const char *image,
+		char **out[]);
+void devreg_unlock(int lckfd);
+void devreg_add(const char *device);
+void devreg_del(const char *device);
+PL_EXT void ploop_devreg_invalidate(void);
+
 /* lock */
 int ploop_lock_di(struct ploop_disk_images_data *di);
 void ploop_unlock_di(struct ploop_disk_images_data *di);
@@ -377,8 +499,10 @@ int resize_gpt_partition(const char *devname, __u64 new_size);
 // misc
 void get_basedir(const char *fname, char *out, int len);
 __u32 ploop_crc32(const unsigned char *buf, unsigned long len);
+__u32 ploop_crc32c(const unsigned char *buf, unsigned long len);
 int store_statfs_info(const char *mnt, char *image);
 int drop_statfs_info(const char *image);
+void drop_image_csum(const char *image);
 int read_statfs_info(const char *image, struct ploop_info *info);
 int get_statfs_info(const char *mnt, struct ploop_info *info);
 int ploop_get_child_count_by_uuid(struct ploop_disk_images_data *di, const char *guid);
@@ -392,17 +516,22 @@ int run_prg(char *const argv[]);
 int run_prg_rc(char *const argv[], int *rc);
 int p_memalign(void **memptr, size_t alignment, size_t size);
 PL_EXT int guidcmp(const char *p1, const char *p2);
+int mount_image(struct ploop_disk_images_data *di,
+		struct ploop_mount_param *param, int flags);
 int auto_mount_image(struct ploop_disk_images_data *di,
 		struct ploop_mount_param *param);
 void free_mount_param(struct ploop_mount_param *param);
 int check_and_restore_fmt_version(struct ploop_disk_images_data *di);
 int check_blockdev_size(unsigned long long sectors, __u32 blocksize, int version);
+int get_image_param(struct ploop_disk_images_data *di, const char *guid,
+		off_t *size, __u32 *blocksize, int *version);
 
 // merge
 PL_EXT int get_delta_info(const char *device, struct merge_info *info);
 PL_EXT int merge_image(const char *device, int start_level, int end_level, int raw, int merge_top,
 		char **images);
-int ploop_merge_snapshot_by_guid(struct ploop_disk_images_data *di, const char *guid, int merge_mode);
+int ploop_merge_snapshot_by_guid(struct ploop_disk_images_data *di,
+		const char *guid, int merge_mode, struct ploop_merge_param *param);
 
 PL_EXT int ploop_change_fmt_version(struct ploop_disk_images_data *di,
 		int new_version, int flags);
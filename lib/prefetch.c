@@ -0,0 +1,148 @@
+/*
+ *  Copyright (C) 2008-2012, Parallels, Inc. All rights reserved.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/* Warm-up of a device being mounted.
+ *
+ * Until the kernel has read the index page covering a region, the first
+ * I/O there waits for the index reads from the deltas, so a starting
+ * container does a burst of small random reads. With a budget given in
+ * the mount parameters we start reading ahead of time:
+ *  - the index of the deltas, before the deltas are added;
+ *  - the clusters of a hot cluster list, then one block per index page,
+ *    through the started device, which fills the kernel map cache.
+ * All the reads are readahead requests, so they run in parallel and the
+ * mount does not wait for them. Failures are not fatal.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#include <linux/types.h>
+
+#include "ploop.h"
+
+/* Start reading the header and index of the deltas, top delta first */
+void prefetch_deltas(char **images, int raw, __u64 *budget)
+{
+	struct ploop_pvd_header vh;
+	__u64 len;
+	int i, fd;
+
+	for (i = 0; images[i] != NULL; i++)
+		;
+
+	for (i--; i >= (raw ? 1 : 0) && *budget > 0; i--) {
+		fd = open(images[i], O_RDONLY | O_CLOEXEC);
+		if (fd == -1) {
+			ploop_err(errno, "Can't open %s", images[i]);
+			continue;
+		}
+
+		if (pread(fd, &vh, sizeof(vh), 0) != sizeof(vh) ||
+				ploop1_version(&vh) == PLOOP_FMT_ERROR) {
+			close(fd);
+			continue;
+		}
+
+		len = S2B(vh.m_FirstBlockOffset);
+		if (len > *budget)
+			len = *budget;
+		posix_fadvise(fd, 0, len, POSIX_FADV_WILLNEED);
+		*budget -= len;
+
+		close(fd);
+	}
+}
+
+static int prefetch_hot(int fd, const char *list, __u64 cluster,
+		__u64 nclu, __u64 *budget)
+{
+	FILE *fp;
+	char buf[64];
+	char *endptr;
+	__u64 clu;
+	int n = 0;
+
+	fp = fopen(list, "r");
+	if (fp == NULL) {
+		ploop_err(errno, "Can't open %s", list);
+		return 0;
+	}
+
+	/* one cluster number per line */
+	while (*budget >= cluster && fgets(buf, sizeof(buf), fp) != NULL) {
+		if (buf[0] == '#' || buf[0] == '\n')
+			continue;
+		clu = strtoull(buf, &endptr, 0);
+		if (endptr == buf || clu >= nclu)
+			continue;
+
+		posix_fadvise(fd, clu * cluster, cluster, POSIX_FADV_WILLNEED);
+		*budget -= cluster;
+		n++;
+	}
+	fclose(fp);
+
+	return n;
+}
+
+/* Read the hot clusters and touch every index page via the device */
+void prefetch_device(const char *device, __u32 blocksize, __u64 budget,
+		const char *list)
+{
+	__u64 size, cluster, nclu, per_page, first;
+	int fd, n_hot = 0, n_idx = 0;
+
+	if (budget == 0)
+		return;
+
+	fd = open(device, O_RDONLY | O_CLOEXEC);
+	if (fd == -1) {
+		ploop_err(errno, "Can't open %s", device);
+		return;
+	}
+
+	if (ioctl(fd, BLKGETSIZE64, &size)) {
+		ploop_err(errno, "BLKGETSIZE64 %s", device);
+		goto out;
+	}
+
+	cluster = S2B(blocksize);
+	nclu = size / cluster;
+	if (list != NULL)
+		n_hot = prefetch_hot(fd, list, cluster, nclu, &budget);
+
+	/* index page p maps clusters from p * per_page - PLOOP_MAP_OFFSET */
+	per_page = cluster / sizeof(__u32);
+	for (first = 0; first < nclu && budget >= cluster; n_idx++) {
+		posix_fadvise(fd, first * cluster, SECTOR_SIZE,
+				POSIX_FADV_WILLNEED);
+		budget -= cluster;
+		first = (n_idx + 1) * per_page - PLOOP_MAP_OFFSET;
+	}
+
+	ploop_log(0, "Prefetching %d hot clusters and %d index pages of %s",
+			n_hot, n_idx, device);
+out:
+	close(fd);
+}
@@ -0,0 +1,578 @@
+/*
+ *  Copyright (C) 2008-2012, Parallels, Inc. All rights reserved.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/* Scrubbing of snapshot deltas.
+ *
+ * Every read-only delta of the chain gets a sidecar file with a checksum
+ * of each cluster of the image file. The sidecar is generated on the
+ * first scrub and is regenerated whenever the delta file changes (merge).
+ * Subsequent scrubs read the deltas back and report clusters whose
+ * checksum does not match anymore. Both passes count against the byte
+ * limit and the rate of a scrub, so a big delta may take several runs
+ * to get all of its checksums; verification starts after that.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <limits.h>
+#include <string.h>
+#include <stddef.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <linux/types.h>
+
+#include "ploop.h"
+
+#define SCRUB_CSUM_FNAME(fname, image) \
+	snprintf(fname, sizeof(fname), "%s.csum", image)
+#define SCRUB_CSUM_MAGIC	0x43534d32 /* "CSM2", CRC32C sums */
+#define SCRUB_BATCH		64	/* clusters taken by a worker at once */
+#define MAX_SCRUB_THREADS	16
+#define DEF_SCRUB_THREADS	4
+#define NO_VCLUSTER		((__u32)-1)
+
+struct csum_header {
+	__u32 magic;
+	__u32 blocksize;
+	__u32 nr_clusters;
+	__u32 cursor;		/* first cluster of the next partial scrub */
+	__u32 generated;	/* clusters from 0 that have a checksum */
+	__u32 data_csum;	/* checksum of the checksum array */
+	__u64 ino;		/* identity of the delta file ... */
+	__u64 size;
+	__u64 mtime_ns;		/* ... at the time checksums were taken */
+	__u32 csum;		/* checksum of this header */
+};
+
+struct scrub_limiter {
+	pthread_mutex_t lock;
+	__u64 rate;		/* bytes per second, 0 - unlimited */
+	__u64 bytes;
+	struct timespec start;
+};
+
+struct scrub_ctx {
+	int fd;
+	__u64 cluster;
+	__u32 nr;		/* clusters in the file */
+	__u32 start;		/* first cluster to process */
+	__u32 count;		/* clusters to process */
+	__u32 next;		/* next work item, relative to start */
+	int generate;
+	__u32 *sums;
+	__u32 *bad;		/* mismatched clusters */
+	__u32 nbad;
+	int err;
+	int stop;
+	pthread_t caller;
+	pthread_mutex_t lock;
+	struct scrub_limiter *limiter;
+};
+
+static __u64 ts2ns(struct timespec *ts)
+{
+	return (__u64)ts->tv_sec * 1000000000ULL + ts->tv_nsec;
+}
+
+static __u32 csum_header_csum(struct csum_header *h)
+{
+	return ploop_crc32((unsigned char *)h, offsetof(struct csum_header, csum));
+}
+
+static void scrub_throttle(struct scrub_limiter *l, __u64 bytes)
+{
+	struct timespec now;
+	__u64 due, elapsed;
+
+	if (l->rate == 0)
+		return;
+
+	pthread_mutex_lock(&l->lock);
+	l->bytes += bytes;
+	due = l->bytes / l->rate * 1000000000ULL +
+		l->bytes % l->rate * 1000000000ULL / l->rate;
+	pthread_mutex_unlock(&l->lock);
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	elapsed = ts2ns(&now) - ts2ns(&l->start);
+	if (due > elapsed)
+		usleep((due - elapsed) / 1000);
+}
+
+static void scrub_cluster(struct scrub_ctx *ctx, void *buf, __u32 clu)
+{
+	ssize_t n;
+	__u32 crc;
+
+	scrub_throttle(ctx->limiter, ctx->cluster);
+
+	n = pread(ctx->fd, buf, ctx->cluster, (off_t)clu * ctx->cluster);
+	if (n <= 0) {
+		ploop_err(n ? errno : 0, "Can't read cluster %u", clu);
+		pthread_mutex_lock(&ctx->lock);
+		ctx->err = SYSEXIT_READ;
+		ctx->stop = 1;
+		pthread_mutex_unlock(&ctx->lock);
+		return;
+	}
+	crc = ploop_crc32c(buf, n);
+
+	if (ctx->generate) {
+		ctx->sums[clu] = crc;
+	} else if (ctx->sums[clu] != crc) {
+		pthread_mutex_lock(&ctx->lock);
+		ctx->bad[ctx->nbad++] = clu;
+		pthread_mutex_unlock(&ctx->lock);
+	}
+}
+
+static void *scrub_worker(void *data)
+{
+	struct scrub_ctx *ctx = data;
+	int caller = pthread_equal(pthread_self(), ctx->caller);
+	void *buf;
+	__u32 i, j, end;
+
+	if (p_memalign(&buf, 4096, ctx->cluster)) {
+		pthread_mutex_lock(&ctx->lock);
+		ctx->err = SYSEXIT_MALLOC;
+		ctx->stop = 1;
+		pthread_mutex_unlock(&ctx->lock);
+		return NULL;
+	}
+
+	for (;;) {
+		/* is_operation_cancelled() reads a thread local flag, so
+		 * only the thread that called ploop_scrub_image() can see
+		 * the cancel; it stops the helpers through ctx->stop
+		 */
+		if (caller && is_operation_cancelled()) {
+			pthread_mutex_lock(&ctx->lock);
+			ctx->err = SYSEXIT_ABORT;
+			ctx->stop = 1;
+			pthread_mutex_unlock(&ctx->lock);
+		}
+
+		pthread_mutex_lock(&ctx->lock);
+		if (ctx->stop || ctx->next >= ctx->count) {
+			pthread_mutex_unlock(&ctx->lock);
+			break;
+		}
+		i = ctx->next;
+		ctx->next += SCRUB_BATCH;
+		pthread_mutex_unlock(&ctx->lock);
+
+		end = i + SCRUB_BATCH;
+		if (end > ctx->count)
+			end = ctx->count;
+		for (j = i; j < end && !ctx->stop; j++)
+			scrub_cluster(ctx, buf, (ctx->start + j) % ctx->nr);
+	}
+
+	free(buf);
+	return NULL;
+}
+
+static int run_scrub(struct scrub_ctx *ctx, int nthreads)
+{
+	pthread_t threads[MAX_SCRUB_THREADS];
+	int i, n, ret;
+
+	ctx->caller = pthread_self();
+	for (n = 0; n < nthreads - 1; n++) {
+		ret = pthread_create(&threads[n], NULL, scrub_worker, ctx);
+		if (ret) {
+			ploop_err(ret, "Can't create thread");
+			break;
+		}
+	}
+
+	scrub_worker(ctx);
+
+	for (i = 0; i < n; i++)
+		pthread_join(threads[i], NULL);
+
+	return ctx->err;
+}
+
+static int read_csum_file(const char *image, struct csum_header *h,
+		__u32 **sums_p)
+{
+	int fd;
+	__u32 *sums;
+	size_t len;
+	char fname[PATH_MAX];
+
+	SCRUB_CSUM_FNAME(fname, image);
+	fd = open(fname, O_RDONLY);
+	if (fd == -1) {
+		if (errno != ENOENT)
+			ploop_err(errno, "Can't open %s", fname);
+		return 1;
+	}
+
+	if (read(fd, h, sizeof(*h)) != sizeof(*h) ||
+			h->magic != SCRUB_CSUM_MAGIC ||
+			h->csum != csum_header_csum(h)) {
+		close(fd);
+		return 1;
+	}
+
+	len = (size_t)h->nr_clusters * sizeof(__u32);
+	sums = malloc(len);
+	if (sums == NULL) {
+		ploop_err(ENOMEM, "malloc");
+		close(fd);
+		return 1;
+	}
+	if (read(fd, sums, len) != len ||
+			ploop_crc32((unsigned char *)sums, len) != h->data_csum) {
+		free(sums);
+		close(fd);
+		return 1;
+	}
+	close(fd);
+
+	*sums_p = sums;
+	return 0;
+}
+
+static int write_csum_file(const char *image, struct csum_header *h,
+		__u32 *sums)
+{
+	int fd, ret = 0;
+	size_t len = (size_t)h->nr_clusters * sizeof(__u32);
+	char fname[PATH_MAX];
+	char tmp[PATH_MAX + 4];
+
+	SCRUB_CSUM_FNAME(fname, image);
+	snprintf(tmp, sizeof(tmp), "%s.tmp", fname);
+
+	fd = open(tmp, O_WRONLY|O_CREAT|O_TRUNC, 0600);
+	if (fd == -1) {
+		ploop_err(errno, "Can't create %s", tmp);
+		return SYSEXIT_CREAT;
+	}
+
+	h->data_csum = ploop_crc32((unsigned char *)sums, len);
+	h->csum = csum_header_csum(h);
+	if (write(fd, h, sizeof(*h)) != sizeof(*h) ||
+			write(fd, sums, len) != len) {
+		ploop_err(errno, "Can't write %s", tmp);
+		ret = SYSEXIT_WRITE;
+	} else if (fsync(fd)) {
+		ploop_err(errno, "fsync %s", tmp);
+		ret = SYSEXIT_FSYNC;
+	}
+	close(fd);
+
+	if (ret == 0 && rename(tmp, fname)) {
+		ploop_err(errno, "Can't rename %s to %s", tmp, fname);
+		ret = SYSEXIT_RENAME;
+	}
+	if (ret)
+		unlink(tmp);
+
+	return ret;
+}
+
+/* Update the partial scrub position only, the sums stay the same */
+static void write_csum_cursor(const char *image, struct csum_header *h)
+{
+	int fd;
+	char fname[PATH_MAX];
+
+	SCRUB_CSUM_FNAME(fname, image);
+	fd = open(fname, O_WRONLY);
+	if (fd == -1)
+		return;
+	h->csum = csum_header_csum(h);
+	if (pwrite(fd, h, sizeof(*h), 0) != sizeof(*h))
+		ploop_log(0, "Warning: can't update %s", fname);
+	close(fd);
+}
+
+/* Remove the checksums of a delta being deleted */
+void drop_image_csum(const char *image)
+{
+	char fname[PATH_MAX];
+
+	SCRUB_CSUM_FNAME(fname, image);
+	unlink(fname);
+}
+
+/* Build image block -> virtual cluster map for the report */
+static __u32 *build_rmap(int fd, __u32 nr, int raw)
+{
+	struct ploop_pvd_header *vh;
+	__u32 *rmap = NULL, *l2;
+	void *buf = NULL;
+	__u32 i, j, l1_slots, vclu, iblk, blocksize;
+	__u64 cluster;
+	int version, skip;
+
+	rmap = malloc(nr * sizeof(__u32));
+	if (rmap == NULL)
+		return NULL;
+	for (i = 0; i < nr; i++)
+		rmap[i] = raw ? i : NO_VCLUSTER;
+	if (raw)
+		return rmap;
+
+	if (p_memalign(&buf, 4096, 4096) ||
+			pread(fd, buf, 4096, 0) != 4096)
+		goto err;
+	vh = buf;
+	version = ploop1_version(vh);
+	blocksize = vh->m_Sectors;
+	cluster = S2B(blocksize);
+	l1_slots = vh->m_FirstBlockOffset / blocksize;
+	free(buf);
+	buf = NULL;
+
+	if (p_memalign(&buf, 4096, cluster))
+		goto err;
+	l2 = buf;
+	vclu = 0;
+	for (i = 0; i < l1_slots && i < nr; i++) {
+		skip = (i == 0) ? sizeof(*vh) / sizeof(__u32) : 0;
+		if (pread(fd, buf, cluster, i * cluster) != cluster)
+			goto err;
+		for (j = skip; j < cluster / 4; j++, vclu++) {
+			if (l2[j] == 0)
+				continue;
+			iblk = ploop_ioff_to_sec(l2[j], blocksize, version) /
+				blocksize;
+			if (iblk < nr)
+				rmap[iblk] = vclu;
+		}
+	}
+	free(buf);
+
+	return rmap;
+
+err:
+	free(buf);
+	free(rmap);
+	return NULL;
+}
+
+static void report_mismatches(struct scrub_ctx *ctx, const char *image,
+		int level, int raw)
+{
+	__u32 i, clu;
+	__u32 *rmap;
+
+	rmap = build_rmap(ctx->fd, ctx->nr, raw);
+	for (i = 0; i < ctx->nbad; i++) {
+		clu = ctx->bad[i];
+		if (rmap == NULL)
+			ploop_err(0, "Checksum mismatch: level %d (%s) image block %u",
+					level, image, clu);
+		else if (rmap[clu] != NO_VCLUSTER)
+			ploop_err(0, "Checksum mismatch: level %d (%s) cluster %u"
+					" (image block %u)",
+					level, image, rmap[clu], clu);
+		else
+			ploop_err(0, "Checksum mismatch: level %d (%s) image block %u"
+					" (index or unused)",
+					level, image, clu);
+	}
+	free(rmap);
+}
+
+static int scrub_delta(const char *image, int level, int raw,
+		__u32 blocksize, struct ploop_scrub_param *param,
+		struct scrub_limiter *limiter, __u64 *budget)
+{
+	int ret;
+	struct stat st, st2;
+	struct csum_header h;
+	struct scrub_ctx ctx = {};
+	int nthreads;
+
+	ctx.fd = open(image, O_RDONLY|O_DIRECT);
+	if (ctx.fd == -1 && errno == EINVAL)
+		ctx.fd = open(image, O_RDONLY);
+	if (ctx.fd == -1) {
+		ploop_err(errno, "Can't open %s", image);
+		return SYSEXIT_OPEN;
+	}
+	if (fstat(ctx.fd, &st)) {
+		ploop_err(errno, "Can't stat %s", image);
+		ret = SYSEXIT_FSTAT;
+		goto out;
+	}
+
+	ctx.cluster = S2B(blocksize);
+	ctx.nr = (st.st_size + ctx.cluster - 1) / ctx.cluster;
+	ctx.limiter = limiter;
+	pthread_mutex_init(&ctx.lock, NULL);
+
+	if (read_csum_file(image, &h, &ctx.sums) ||
+			h.blocksize != blocksize ||
+			h.nr_clusters != ctx.nr ||
+			h.ino != st.st_ino ||
+			h.size != st.st_size ||
+			h.mtime_ns != ts2ns(&st.st_mtim)) {
+		free(ctx.sums);
+		ctx.sums = calloc(ctx.nr ? ctx.nr : 1, sizeof(__u32));
+		if (ctx.sums == NULL) {
+			ploop_err(ENOMEM, "calloc");
+			ret = SYSEXIT_MALLOC;
+			goto out;
+		}
+		memset(&h, 0, sizeof(h));
+		h.magic = SCRUB_CSUM_MAGIC;
+		h.blocksize = blocksize;
+		h.nr_clusters = ctx.nr;
+		h.ino = st.st_ino;
+		h.size = st.st_size;
+		h.mtime_ns = ts2ns(&st.st_mtim);
+	}
+
+	if (h.generated < ctx.nr) {
+		/* continue where the previous partial run stopped */
+		ctx.generate = 1;
+		ctx.start = h.generated;
+		ctx.count = ctx.nr - h.generated;
+	} else {
+		ctx.start = h.cursor < ctx.nr ? h.cursor : 0;
+		ctx.count = ctx.nr;
+	}
+	if (param->max_bytes) {
+		if (*budget / ctx.cluster < ctx.count)
+			ctx.count = *budget / ctx.cluster;
+		*budget -= (__u64)ctx.count * ctx.cluster;
+	}
+	if (ctx.count == 0) {
+		ret = 0;
+		goto out;
+	}
+
+	if (ctx.generate) {
+		ploop_log(0, "Generating checksums for %s: %u of %u clusters from %u",
+				image, ctx.count, ctx.nr, ctx.start);
+	} else {
+		ctx.bad = malloc(ctx.count * sizeof(__u32));
+		if (ctx.bad == NULL) {
+			ploop_err(ENOMEM, "malloc");
+			ret = SYSEXIT_MALLOC;
+			goto out;
+		}
+		ploop_log(0, "Verifying %s: %u of %u clusters from %u",
+				image, ctx.count, ctx.nr, ctx.start);
+	}
+
+	nthreads = param->threads ? param->threads : DEF_SCRUB_THREADS;
+	if (nthreads > MAX_SCRUB_THREADS)
+		nthreads = MAX_SCRUB_THREADS;
+
+	ret = run_scrub(&ctx, nthreads);
+	if (ret)
+		goto out;
+
+	/* the delta may have been merged into while we were reading it */
+	if (fstat(ctx.fd, &st2)) {
+		ploop_err(errno, "Can't stat %s", image);
+		ret = SYSEXIT_FSTAT;
+		goto out;
+	}
+	if (st2.st_size != st.st_size ||
+			ts2ns(&st2.st_mtim) != ts2ns(&st.st_mtim)) {
+		ploop_log(0, "%s was modified during scrub, results dropped",
+				image);
+		goto out;
+	}
+
+	if (ctx.generate) {
+		h.generated = ctx.start + ctx.count;
+		ret = write_csum_file(image, &h, ctx.sums);
+		goto out;
+	}
+
+	if (ctx.nbad) {
+		report_mismatches(&ctx, image, level, raw);
+		param->mismatches += ctx.nbad;
+	}
+	h.cursor = (ctx.start + ctx.count) % ctx.nr;
+	write_csum_cursor(image, &h);
+
+out:
+	pthread_mutex_destroy(&ctx.lock);
+	free(ctx.bad);
+	free(ctx.sums);
+	close(ctx.fd);
+
+	return ret;
+}
+
+int ploop_scrub_image(struct ploop_disk_images_data *di,
+		struct ploop_scrub_param *param)
+{
+	int i, n, ret;
+	char **images;
+	__u32 blocksize;
+	__u64 budget = param->max_bytes;
+	struct scrub_limiter limiter = {
+		.rate = param->rate,
+	};
+
+	if (ploop_lock_di(di))
+		return SYSEXIT_LOCK;
+	images = make_images_list(di, di->top_guid, 0);
+	blocksize = di->blocksize;
+	ploop_unlock_di(di);
+	if (images == NULL)
+		return SYSEXIT_DISKDESCR;
+
+	param->mismatches = 0;
+	pthread_mutex_init(&limiter.lock, NULL);
+	clock_gettime(CLOCK_MONOTONIC, &limiter.start);
+
+	/* the top delta is writable and is not scrubbed */
+	n = get_list_size(images) - 1;
+	if (n == 0)
+		ploop_log(0, "No snapshot deltas to scrub");
+
+	ret = 0;
+	for (i = 0; i < n; i++) {
+		ret = scrub_delta(images[i], i,
+				i == 0 && di->mode == PLOOP_RAW_MODE,
+				blocksize, param, &limiter, &budget);
+		if (ret)
+			break;
+		if (param->max_bytes && budget < S2B(blocksize))
+			break;
+	}
+
+	pthread_mutex_destroy(&limiter.lock);
+	free_images_list(images);
+
+	if (ret == 0 && param->mismatches) {
+		ploop_err(0, "Found %llu corrupted clusters",
+				(unsigned long long)param->mismatches);
+		ret = SYSEXIT_CSUM;
+	}
+
+	return ret;
+}
@@ -0,0 +1,210 @@
+/*
+ *  Copyright (C) 2008-2012, Parallels, Inc. All rights reserved.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/* Changed clusters between two snapshots.
+ *
+ * A cluster can only differ between the states of two snapshots if it
+ * was written to one of the deltas that are in one chain but not in the
+ * other, i.e. the deltas from the common ancestor up to each snapshot.
+ * So the diff is the union of the clusters mapped by the index tables of
+ * those deltas; no data is read. Clusters written with the same data
+ * again are reported as changed too.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <linux/types.h>
+
+#include "ploop.h"
+
+/* index is read in chunks of this size, rounded up to a cluster */
+#define DIFF_READ_CHUNK		(4 << 20)
+
+static int resize_bitmap(struct ploop_snapshot_diff *d, __u64 nclusters)
+{
+	__u64 *p;
+	__u64 n = (nclusters + 63) / 64;
+	__u64 old = (d->nclusters + 63) / 64;
+
+	if (nclusters <= d->nclusters)
+		return 0;
+
+	p = realloc(d->bitmap, n * sizeof(__u64));
+	if (p == NULL) {
+		ploop_err(ENOMEM, "Memory allocation failed");
+		return SYSEXIT_MALLOC;
+	}
+	memset(p + old, 0, (n - old) * sizeof(__u64));
+	d->bitmap = p;
+	d->nclusters = nclusters;
+
+	return 0;
+}
+
+/* Set the bits of the clusters mapped by @image */
+static int add_delta(struct ploop_snapshot_diff *d, const char *image)
+{
+	struct delta delta = {};
+	__u32 *buf = NULL;
+	__u64 cluster, chunk, len, g, slot;
+	off_t off, end;
+	int ret;
+
+	if (open_delta(&delta, image, O_RDONLY, OD_ALLOW_DIRTY | OD_OFFLINE))
+		return SYSEXIT_OPEN;
+
+	if (delta.blocksize != d->blocksize) {
+		ploop_err(0, "Delta %s has block size %u, %u expected",
+				image, delta.blocksize, d->blocksize);
+		ret = SYSEXIT_PARAM;
+		goto err;
+	}
+
+	ret = resize_bitmap(d, delta.l2_size);
+	if (ret)
+		goto err;
+
+	cluster = S2B(delta.blocksize);
+	chunk = (DIFF_READ_CHUNK + cluster - 1) / cluster * cluster;
+	end = (off_t)delta.l1_size * cluster;
+	if (chunk > end)
+		chunk = end;
+	if (p_memalign((void **)&buf, 4096, chunk)) {
+		ret = SYSEXIT_MALLOC;
+		goto err;
+	}
+
+	for (off = 0; off < end; off += len) {
+		if (is_operation_cancelled()) {
+			ret = SYSEXIT_ABORT;
+			goto err;
+		}
+
+		len = end - off < chunk ? end - off : chunk;
+		if (PREAD(&delta, buf, len, off)) {
+			ret = SYSEXIT_READ;
+			goto err;
+		}
+
+		for (g = off / sizeof(__u32);
+				g < (off + len) / sizeof(__u32); g++) {
+			if (g < PLOOP_MAP_OFFSET)
+				continue;
+			slot = g - PLOOP_MAP_OFFSET;
+			if (slot >= delta.l2_size)
+				break;
+			if (buf[g - off / sizeof(__u32)] != 0)
+				d->bitmap[slot / 64] |= 1ULL << (slot % 64);
+		}
+	}
+
+err:
+	free(buf);
+	close_delta(&delta);
+
+	return ret;
+}
+
+int ploop_snapshot_diff(struct ploop_disk_images_data *di,
+		const char *guid_from, const char *guid_to,
+		struct ploop_snapshot_diff **out)
+{
+	struct ploop_snapshot_diff *d;
+	char **from = NULL, **to = NULL;
+	int i, n, ret;
+	__u64 k;
+
+	if (di->nimages == 0) {
+		ploop_err(0, "No images");
+		return SYSEXIT_PARAM;
+	}
+	if (guid_from == NULL) {
+		ploop_err(0, "Snapshot guid is not specified");
+		return SYSEXIT_PARAM;
+	}
+
+	if (guid_to == NULL)
+		guid_to = di->top_guid;
+
+	d = calloc(1, sizeof(struct ploop_snapshot_diff));
+	if (d == NULL) {
+		ploop_err(ENOMEM, "Memory allocation failed");
+		return SYSEXIT_MALLOC;
+	}
+	d->blocksize = di->blocksize;
+
+	if (ploop_lock_di(di)) {
+		free(d);
+		return SYSEXIT_LOCK;
+	}
+
+	from = make_images_list(di, guid_from, 0);
+	to = make_images_list(di, guid_to, 0);
+	if (from == NULL || to == NULL) {
+		ret = SYSEXIT_PARAM;
+		goto err;
+	}
+
+	/* the part of the chains both snapshots share */
+	for (n = 0; from[n] != NULL && to[n] != NULL &&
+			!strcmp(from[n], to[n]); n++)
+		;
+	if (n == 0) {
+		ploop_err(0, "Snapshots %s and %s have different base images",
+				guid_from, guid_to);
+		ret = SYSEXIT_PARAM;
+		goto err;
+	}
+
+	ret = 0;
+	for (i = n; from[i] != NULL && ret == 0; i++)
+		ret = add_delta(d, from[i]);
+	for (i = n; to[i] != NULL && ret == 0; i++)
+		ret = add_delta(d, to[i]);
+	if (ret)
+		goto err;
+
+	for (k = 0; k < (d->nclusters + 63) / 64; k++)
+		d->changed += __builtin_popcountll(d->bitmap[k]);
+
+	ploop_log(3, "Snapshot diff %s..%s: %llu of %llu clusters changed",
+			guid_from, guid_to, (unsigned long long)d->changed,
+			(unsigned long long)d->nclusters);
+	*out = d;
+	d = NULL;
+
+err:
+	ploop_unlock_di(di);
+	free_images_list(from);
+	free_images_list(to);
+	ploop_free_snapshot_diff(d);
+
+	return ret;
+}
+
+void ploop_free_snapshot_diff(struct ploop_snapshot_diff *diff)
+{
+	if (diff == NULL)
+		return;
+
+	free(diff->bitmap);
+	free(diff);
+}
@@ -99,7 +99,8 @@ static int fill_opts(void)
 
 static void usage_summary(void)
 {
-	fprintf(stderr, "Usage: ploop-balloon { show | status | clear | change | complete | check | repair | discard } ...\n"
+	fprintf(stderr, "Usage: ploop-balloon { show | status | clear | change | complete | check | repair |\n"
+			"                       discard | discard-sched } ...\n"
 			"Use \"ploop-balloon cmd\" to get more info about cmd\n"
 		);
 }
@@ -422,8 +423,11 @@ static void usage_discard(void)
 		);
 }
 
-static void print_discard_stat(struct ploop_discard_stat *stat)
+static void print_discard_stat(struct ploop_discard_stat_ex *stat_ex)
 {
+	struct ploop_discard_stat *stat = &stat_ex->stat;
+	int i;
+
 	fprintf(stdout, "Balloon size: %8lluMB\n",
 			(unsigned long long)stat->balloon_size >> 20);
 	fprintf(stdout, "Data size:    %8lluMB\n",
@@ -432,6 +436,22 @@ static void print_discard_stat(struct ploop_discard_stat *stat)
 			(unsigned long long)stat->ploop_size >> 20);
 	fprintf(stdout, "Image size:   %8lluMB\n",
 			(unsigned long long)stat->image_size >> 20);
+
+	if (!stat_ex->hist_valid)
+		return;
+
+	fprintf(stdout, "Free extents:\n"
+			"  %10s %10s %12s %14s\n",
+			"min-block", "extents", "size", "reclaimable");
+	for (i = 0; i < PLOOP_FREE_HIST_SIZE; i++) {
+		if (stat_ex->reclaimable[i] == 0)
+			break;
+		fprintf(stdout, "  %8lluKB %10llu %10lluMB %12lluMB\n",
+				((unsigned long long)stat_ex->cluster << i) >> 10,
+				(unsigned long long)stat_ex->free_extents[i],
+				(unsigned long long)stat_ex->free_bytes[i] >> 20,
+				(unsigned long long)stat_ex->reclaimable[i] >> 20);
+	}
 }
 
 static int pb_discard(int argc, char **argv)
@@ -506,12 +526,13 @@ static int pb_discard(int argc, char **argv)
 	}
 
 	if (stat) {
-		struct ploop_discard_stat d_stat;
+		struct ploop_discard_stat_ex d_stat;
 
 		if (di)
-			ret = ploop_discard_get_stat(di, &d_stat);
+			ret = ploop_discard_get_stat_ex(di, &d_stat);
 		else
-			ret = ploop_discard_get_stat_by_dev(device, mount_point, &d_stat);
+			ret = ploop_discard_get_stat_ex_by_dev(device, mount_point,
+					&d_stat);
 
 		if (ret == 0)
 			print_discard_stat(&d_stat);
@@ -529,6 +550,94 @@ static int pb_discard(int argc, char **argv)
 	return ret;
 }
 
+static void usage_discard_sched(void)
+{
+	fprintf(stderr, "Usage: ploop-balloon discard-sched [-j JOBS] [-i INTERVAL] [--rate RATE]\n"
+			"                     [--step SIZE] [--min-gain SIZE] [--min-block MIN_SIZE]\n"
+			"       JOBS        := number of images discarded at once (default 1)\n"
+			"       INTERVAL    := seconds between scans, run once if not set\n"
+			"       RATE        := NUMBER[KMGT] (space to free per second, all images)\n"
+			"       SIZE        := NUMBER[KMGT] (space to free per run / minimal gain)\n"
+			"       MIN_SIZE    := NUMBER[KMGT] (minimum size of a linear slice to be freed)\n"
+			"Action: discard unused blocks from all mounted images, most profitable first.\n"
+		);
+}
+
+static int pb_discard_sched(int argc, char **argv)
+{
+	int i;
+	off_t val;
+	char *endptr;
+	static struct option long_opts[] = {
+		{ "rate", required_argument, 0, 666 },
+		{ "step", required_argument, 0, 667 },
+		{ "min-gain", required_argument, 0, 668 },
+		{ "min-block", required_argument, 0, 669 },
+		{},
+	};
+	struct ploop_discard_sched_param param = {};
+
+	while ((i = getopt_long(argc, argv, "j:i:", long_opts, NULL)) != EOF) {
+		switch (i) {
+		case 'j':
+			param.max_jobs = strtoul(optarg, &endptr, 0);
+			if (*endptr != '\0' || param.max_jobs <= 0) {
+				usage_discard_sched();
+				return SYSEXIT_PARAM;
+			}
+			break;
+		case 'i':
+			param.interval = strtoul(optarg, &endptr, 0);
+			if (*endptr != '\0') {
+				usage_discard_sched();
+				return SYSEXIT_PARAM;
+			}
+			break;
+		case 666:
+			if (parse_size(optarg, &val, "--rate")) {
+				usage_discard_sched();
+				return SYSEXIT_PARAM;
+			}
+			param.bw_limit = S2B(val);
+			break;
+		case 667:
+			if (parse_size(optarg, &val, "--step")) {
+				usage_discard_sched();
+				return SYSEXIT_PARAM;
+			}
+			param.step = S2B(val);
+			break;
+		case 668:
+			if (parse_size(optarg, &val, "--min-gain")) {
+				usage_discard_sched();
+				return SYSEXIT_PARAM;
+			}
+			param.min_gain = S2B(val);
+			break;
+		case 669:
+			if (parse_size(optarg, &val, "--min-block")) {
+				usage_discard_sched();
+				return SYSEXIT_PARAM;
+			}
+			param.minlen_b = S2B(val);
+			break;
+		default:
+			usage_discard_sched();
+			return SYSEXIT_PARAM;
+		}
+	}
+
+	argc -= optind;
+	argv += optind;
+
+	if (argc != 0) {
+		usage_discard_sched();
+		return SYSEXIT_PARAM;
+	}
+
+	return ploop_discard_schedule(&param);
+}
+
 int main(int argc, char **argv)
 {
 	char *cmd;
@@ -561,6 +670,8 @@ int main(int argc, char **argv)
 		return pb_check_and_repair(argc, argv, 1); /* check and repair */
 	if (strcmp(cmd, "discard") == 0)
 		return pb_discard(argc, argv);
+	if (strcmp(cmd, "discard-sched") == 0)
+		return pb_discard_sched(argc, argv);
 
 	usage_summary();
 	return SYSEXIT_PARAM;
@@ -17,20 +17,58 @@
  */
 
 #include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
 #include <fcntl.h>
 #include <string.h>
 #include <getopt.h>
 #include <dirent.h>
 #include <unistd.h>
 #include <limits.h>
+#include <signal.h>
+#include <time.h>
 
 #include "ploop.h"
 
 #define FMT "/sys/block/%s/pstat"
 
+enum {
+	OUT_RAW,	/* no -i nor -o: the counters as the kernel has them */
+	OUT_TEXT,
+	OUT_JSON,
+	OUT_PROM,
+};
+
+struct stat_cnt {
+	char name[NAME_MAX + 1];
+	int fd;
+	unsigned long long val;
+	unsigned long long prev;
+};
+
+struct stat_dev {
+	char name[NAME_MAX + 1];
+	struct stat_cnt *cnt;
+	int n;
+	int has_prev;
+};
+
+struct stat_set {
+	struct stat_dev *dev;
+	int n;
+};
+
+static volatile sig_atomic_t stat_stop;
+
 static void usage(void)
 {
-	fprintf(stderr, "Usage: ploop stat [-c | -l] -d DEVICE\n");
+	fprintf(stderr, "Usage: ploop stat [-c | -l] -d DEVICE\n"
+			"       ploop stat [-i INTERVAL [-n COUNT]] [-o FORMAT] { -d DEVICE | -a }\n"
+			"       INTERVAL := seconds between samples, rates are shown\n"
+			"       COUNT := number of samples, unlimited by default\n"
+			"       FORMAT := { text | json | prometheus }\n"
+			"       -a     - all ploop devices\n"
+		);
 }
 
 static int open_sysfs_file(char * devid, char *name, int flags)
@@ -50,17 +88,344 @@ static DIR * open_sysfs_dir(char * devid)
 	return opendir(buf);
 }
 
+static int cnt_cmp(const void *a, const void *b)
+{
+	return strcmp(((struct stat_cnt *)a)->name, ((struct stat_cnt *)b)->name);
+}
+
+static int dev_cmp(const void *a, const void *b)
+{
+	return strcmp(((struct stat_dev *)a)->name, ((struct stat_dev *)b)->name);
+}
+
+static void dev_close(struct stat_dev *d)
+{
+	int i;
+
+	for (i = 0; i < d->n; i++)
+		close(d->cnt[i].fd);
+	free(d->cnt);
+	d->cnt = NULL;
+	d->n = 0;
+}
+
+/* Open all the counters of a device once, they are re-read by pread() */
+static int dev_open(struct stat_dev *d, const char *devid)
+{
+	DIR *dp;
+	struct dirent *de;
+	struct stat_cnt *t;
+
+	memset(d, 0, sizeof(*d));
+	snprintf(d->name, sizeof(d->name), "%s", devid);
+
+	dp = open_sysfs_dir(d->name);
+	if (dp == NULL)
+		return -1;
+
+	while ((de = readdir(dp)) != NULL) {
+		if (de->d_name[0] == '.')
+			continue;
+
+		t = realloc(d->cnt, (d->n + 1) * sizeof(struct stat_cnt));
+		if (t == NULL) {
+			fprintf(stderr, "Memory allocation failed\n");
+			goto err;
+		}
+		d->cnt = t;
+		t = &d->cnt[d->n];
+		snprintf(t->name, sizeof(t->name), "%s", de->d_name);
+		t->fd = open_sysfs_file(d->name, de->d_name, O_RDONLY);
+		if (t->fd < 0)
+			goto err;
+		d->n++;
+	}
+	closedir(dp);
+
+	qsort(d->cnt, d->n, sizeof(struct stat_cnt), cnt_cmp);
+
+	return 0;
+
+err:
+	closedir(dp);
+	dev_close(d);
+	return -1;
+}
+
+static int dev_read(struct stat_dev *d)
+{
+	char buf[64];
+	int i, n;
+
+	for (i = 0; i < d->n; i++) {
+		n = pread(d->cnt[i].fd, buf, sizeof(buf) - 1, 0);
+		if (n < 0)
+			return -1;
+		buf[n] = '\0';
+		d->cnt[i].prev = d->cnt[i].val;
+		d->cnt[i].val = strtoull(buf, NULL, 0);
+	}
+
+	return 0;
+}
+
+static int find_dev(struct stat_set *s, const char *name)
+{
+	int i;
+
+	for (i = 0; i < s->n; i++)
+		if (strcmp(s->dev[i].name, name) == 0)
+			return i;
+	return -1;
+}
+
+/* Pick up the ploop devices appeared since the last sample */
+static int set_add_all(struct stat_set *s)
+{
+	DIR *dp;
+	struct dirent *de;
+	struct stat_dev *t;
+	int n = s->n;
+
+	dp = opendir("/sys/block");
+	if (dp == NULL) {
+		perror("opendir /sys/block");
+		return SYSEXIT_SYSFS;
+	}
+
+	while ((de = readdir(dp)) != NULL) {
+		if (strncmp(de->d_name, "ploop", 5) ||
+				find_dev(s, de->d_name) != -1)
+			continue;
+
+		t = realloc(s->dev, (s->n + 1) * sizeof(struct stat_dev));
+		if (t == NULL) {
+			fprintf(stderr, "Memory allocation failed\n");
+			closedir(dp);
+			return SYSEXIT_MALLOC;
+		}
+		s->dev = t;
+		if (dev_open(&s->dev[s->n], de->d_name) == 0)
+			s->n++;
+	}
+	closedir(dp);
+
+	if (s->n != n)
+		qsort(s->dev, s->n, sizeof(struct stat_dev), dev_cmp);
+
+	return 0;
+}
+
+/* Read all the devices, the ones gone are dropped in the -a mode */
+static int set_read(struct stat_set *s, int all)
+{
+	int i;
+
+	for (i = 0; i < s->n; i++) {
+		if (dev_read(&s->dev[i]) == 0)
+			continue;
+		if (!all) {
+			perror("read");
+			return SYSEXIT_SYSFS;
+		}
+		dev_close(&s->dev[i]);
+		memmove(&s->dev[i], &s->dev[i + 1],
+				(s->n - i - 1) * sizeof(struct stat_dev));
+		s->n--;
+		i--;
+	}
+
+	return 0;
+}
+
+/* A counter going back was reset (ploop stat -c, device re-created),
+ * it has counted from 0 since then
+ */
+static unsigned long long cnt_delta(struct stat_cnt *c)
+{
+	return c->val >= c->prev ? c->val - c->prev : c->val;
+}
+
+static void print_text(struct stat_set *s, double elapsed, int named)
+{
+	struct stat_cnt *c;
+	int i, j;
+
+	for (i = 0; i < s->n; i++) {
+		if (named)
+			printf("%s\n", s->dev[i].name);
+		for (j = 0; j < s->dev[i].n; j++) {
+			c = &s->dev[i].cnt[j];
+			if (elapsed > 0 && s->dev[i].has_prev)
+				printf("%-20s\t%llu\t%llu\t%.1f/s\n", c->name,
+						c->val, cnt_delta(c),
+						cnt_delta(c) / elapsed);
+			else
+				printf("%-20s\t%llu\n", c->name, c->val);
+		}
+	}
+}
+
+static void print_json(struct stat_set *s, double elapsed)
+{
+	struct stat_cnt *c;
+	struct timespec ts;
+	int i, j;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	printf("{\"timestamp\": %ld.%03ld, \"interval\": %.3f, \"devices\": {",
+			(long)ts.tv_sec, ts.tv_nsec / 1000000, elapsed);
+	for (i = 0; i < s->n; i++) {
+		printf("%s\"%s\": {", i ? ", " : "", s->dev[i].name);
+		for (j = 0; j < s->dev[i].n; j++) {
+			c = &s->dev[i].cnt[j];
+			printf("%s\"%s\": {\"value\": %llu", j ? ", " : "",
+					c->name, c->val);
+			if (elapsed > 0 && s->dev[i].has_prev)
+				printf(", \"delta\": %llu, \"rate\": %.3f",
+						cnt_delta(c),
+						cnt_delta(c) / elapsed);
+			printf("}");
+		}
+		printf("}");
+	}
+	printf("}}\n");
+}
+
+static void print_prom(struct stat_set *s, double elapsed)
+{
+	struct stat_cnt *c;
+	int i, j;
+
+	printf("# HELP ploop_pstat Ploop device statistics counter.\n"
+		"# TYPE ploop_pstat counter\n");
+	for (i = 0; i < s->n; i++)
+		for (j = 0; j < s->dev[i].n; j++) {
+			c = &s->dev[i].cnt[j];
+			printf("ploop_pstat{device=\"%s\",counter=\"%s\"} %llu\n",
+					s->dev[i].name, c->name, c->val);
+		}
+
+	if (elapsed <= 0)
+		return;
+
+	printf("# HELP ploop_pstat_rate Ploop device statistics counter change per second.\n"
+		"# TYPE ploop_pstat_rate gauge\n");
+	for (i = 0; i < s->n; i++) {
+		if (!s->dev[i].has_prev)
+			continue;
+		for (j = 0; j < s->dev[i].n; j++) {
+			c = &s->dev[i].cnt[j];
+			printf("ploop_pstat_rate{device=\"%s\",counter=\"%s\"} %.3f\n",
+					s->dev[i].name, c->name,
+					cnt_delta(c) / elapsed);
+		}
+	}
+}
+
+static void stat_stop_handler(int sig)
+{
+	stat_stop = 1;
+}
+
+static double now_sec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int sample_loop(const char *device, int all, double interval,
+		int count, int out)
+{
+	struct stat_set s = {};
+	struct sigaction act = {};
+	struct timespec ts;
+	double last = 0, now, next, elapsed;
+	int i, k, ret = 0;
+
+	act.sa_handler = stat_stop_handler;
+	sigemptyset(&act.sa_mask);
+	sigaction(SIGINT, &act, NULL);
+	sigaction(SIGTERM, &act, NULL);
+
+	if (!all) {
+		s.dev = calloc(1, sizeof(struct stat_dev));
+		if (s.dev == NULL) {
+			fprintf(stderr, "Memory allocation failed\n");
+			return SYSEXIT_MALLOC;
+		}
+		if (dev_open(&s.dev[0], device)) {
+			perror("sysfs open");
+			free(s.dev);
+			return SYSEXIT_SYSFS;
+		}
+		s.n = 1;
+	}
+
+	next = now_sec();
+	for (k = 0; !stat_stop && (count == 0 || k < count); k++) {
+		if (all && (ret = set_add_all(&s)))
+			break;
+		if ((ret = set_read(&s, all)))
+			break;
+
+		now = now_sec();
+		elapsed = k ? now - last : 0;
+		last = now;
+
+		if (out == OUT_JSON)
+			print_json(&s, elapsed);
+		else if (out == OUT_PROM)
+			print_prom(&s, elapsed);
+		else {
+			print_text(&s, elapsed, all || interval > 0);
+			if (interval > 0)
+				printf("\n");
+		}
+		fflush(stdout);
+
+		for (i = 0; i < s.n; i++)
+			s.dev[i].has_prev = 1;
+
+		if (interval <= 0 || (count && k + 1 == count))
+			break;
+
+		/* keep the samples on the interval grid */
+		next += interval;
+		now = now_sec();
+		if (next > now) {
+			ts.tv_sec = (time_t)(next - now);
+			ts.tv_nsec = (long)((next - now - ts.tv_sec) * 1e9);
+			nanosleep(&ts, NULL);
+		} else
+			next = now;
+	}
+
+	for (i = 0; i < s.n; i++)
+		dev_close(&s.dev[i]);
+	free(s.dev);
+
+	return ret;
+}
+
 int plooptool_stat(int argc, char **argv)
 {
 	int i;
 	int clear = 0;
 	int load = 0;
+	int all = 0;
+	int count = 0;
+	int out = OUT_RAW;
+	double interval = 0;
+	char *endptr;
 	DIR *dp;
 	struct dirent *de;
 	char * device = NULL;
 	int ret = 0;
 
-	while ((i = getopt(argc, argv, "cld:")) != EOF) {
+	while ((i = getopt(argc, argv, "cld:ai:n:o:")) != EOF) {
 		switch (i) {
 		case 'c':
 			clear = 1;
@@ -71,6 +436,35 @@ int plooptool_stat(int argc, char **argv)
 		case 'd':
 			device = optarg;
 			break;
+		case 'a':
+			all = 1;
+			break;
+		case 'i':
+			interval = strtod(optarg, &endptr);
+			if (*endptr != '\0' || interval <= 0) {
+				usage();
+				return SYSEXIT_PARAM;
+			}
+			break;
+		case 'n':
+			count = strtoul(optarg, &endptr, 0);
+			if (*endptr != '\0') {
+				usage();
+				return SYSEXIT_PARAM;
+			}
+			break;
+		case 'o':
+			if (strcmp(optarg, "text") == 0)
+				out = OUT_TEXT;
+			else if (strcmp(optarg, "json") == 0)
+				out = OUT_JSON;
+			else if (strcmp(optarg, "prometheus") == 0)
+				out = OUT_PROM;
+			else {
+				usage();
+				return SYSEXIT_PARAM;
+			}
+			break;
 		default:
 			usage();
 			return SYSEXIT_PARAM;
@@ -80,14 +474,19 @@ int plooptool_stat(int argc, char **argv)
 	argc -= optind;
 	argv += optind;
 
-	if (argc || !device) {
+	if (argc || (!device == !all) || (all && (clear || load)) ||
+			((clear || load) && (interval > 0 || out != OUT_RAW))) {
 		usage();
 		return SYSEXIT_PARAM;
 	}
 
-	if (memcmp(device, "/dev/", 5) == 0)
+	if (device != NULL && memcmp(device, "/dev/", 5) == 0)
 		device += 5;
 
+	if (all || interval > 0 || out != OUT_RAW)
+		return sample_loop(device, all, interval, count,
+				out == OUT_RAW ? OUT_TEXT : out);
+
 	dp = open_sysfs_dir(device);
 	if (dp == NULL) {
 		perror("sysfs opendir");
@@ -51,14 +51,19 @@ static void usage_summary(void)
 			"       ploop umount { -d DEVICE | -m DIR | DELTA | DiskDescriptor.xml }\n"
 			"       ploop check [-fFcrsdS] [-R -b BLOCKSIZE] { DELTA | DiskDescriptor.xml }\n"
 			"       ploop convert [-f FORMAT] [-v VERSION] DiskDescriptor.xml\n"
-			"       ploop resize -s SIZE DiskDescriptor.xml\n"
+			"       ploop resize -s SIZE [-S STEP] [-r RATE] DiskDescriptor.xml\n"
 			"       ploop balloon { show | status | clear | change | complete | check |\n"
-			"                       repair | discard } ... DiskDescriptor.xml\n"
-			"       ploop snapshot DiskDescriptor.xml\n"
+			"                       repair | discard | discard-sched } ... DiskDescriptor.xml\n"
+			"       ploop snapshot [-P COUNT] DiskDescriptor.xml\n"
+			"       ploop snapshot-pool -n COUNT DiskDescriptor.xml\n"
 			"       ploop snapshot-delete -u <uuid> DiskDescriptor.xml\n"
 			"       ploop snapshot-merge [-u <uuid>] DiskDescriptor.xml\n"
 			"       ploop snapshot-switch -u <uuid> DiskDescriptor.xml\n"
 			"       ploop snapshot-list [-o field[,field...]] [-u <UUID>] DiskDescriptor.xml\n"
+			"       ploop snapshot-diff [-s] -u <uuid> [-t <uuid>] DiskDescriptor.xml\n"
+			"       ploop scrub [-j THREADS] [-b RATE] [-l LIMIT] DiskDescriptor.xml\n"
+			"       ploop mount-batch [-j THREADS] DiskDescriptor.xml[:DIR] ...\n"
+			"       ploop umount-batch [-j THREADS] DiskDescriptor.xml ...\n"
 			"Also:  ploop { start | stop | delete | clear | merge | grow | copy |\n"
 			"               stat | info | list} ...\n"
 			"\n"
@@ -178,19 +183,23 @@ static int plooptool_init(int argc, char **argv)
 
 static void usage_mount(void)
 {
-	fprintf(stderr, "Usage: ploop mount [-r] [-f FORMAT] [-b BLOCKSIZE] [-d DEVICE]\n"
+	fprintf(stderr, "Usage: ploop mount [-rJ] [-f FORMAT] [-b BLOCKSIZE] [-d DEVICE]\n"
 			"             [-m MOUNT_POINT] [-t FSTYPE] [-o MOUNT_OPTS]\n"
-			"             BASE_DELTA [ ... TOP_DELTA ]\n"
-			"       ploop mount [-r] [-m MOUNT_POINT] [-u UUID] DiskDescriptor.xml\n"
+			"             [-W BUDGET [-H HOT_LIST]] BASE_DELTA [ ... TOP_DELTA ]\n"
+			"       ploop mount [-rJ] [-m MOUNT_POINT] [-u UUID]\n"
+			"             [-W BUDGET [-H HOT_LIST]] DiskDescriptor.xml\n"
 			"       FORMAT := { raw | ploop1 }\n"
 			"       BLOCKSIZE := block size (for raw image format)\n"
 			"       DEVICE := ploop device, e.g. /dev/ploop0\n"
 			"       MOUNT_POINT := directory to mount in-image filesystem to\n"
 			"       FSTYPE := in-image filesystem type (ext4 by default)\n"
 			"       MOUNT_OPTS := additional mount options, comma-separated\n"
+			"       BUDGET := amount of index and data to prefetch, NUMBER[KMGT]\n"
+			"       HOT_LIST := file with cluster numbers to prefetch, one per line\n"
 			"       *DELTA := path to image file\n"
 			"       -r     - mount images read-only\n"
 			"       -F     - run fsck on inner filesystem before mounting it\n"
+			"       -J     - keep allocation journal for the top delta\n"
 		);
 }
 
@@ -201,9 +210,18 @@ static int plooptool_mount(int argc, char **argv)
 	int base = 0;
 	struct ploop_mount_param mountopts = {};
 	const char *component_name = NULL;
+	off_t size;
 
-	while ((i = getopt(argc, argv, "rFf:d:m:t:u:o:b:c:")) != EOF) {
+	while ((i = getopt(argc, argv, "rFJf:d:m:t:u:o:b:c:W:H:")) != EOF) {
 		switch (i) {
+		case 'W':
+			if (parse_size(optarg, &size, "-W"))
+				return SYSEXIT_PARAM;
+			mountopts.prefetch = S2B(size);
+			break;
+		case 'H':
+			mountopts.prefetch_list = optarg;
+			break;
 		case 'd':
 			strncpy(mountopts.device, optarg, sizeof(mountopts.device)-1);
 			break;
@@ -213,6 +231,9 @@ static int plooptool_mount(int argc, char **argv)
 		case 'F':
 			mountopts.fsck = 1;
 			break;
+		case 'J':
+			mountopts.alloc_journal = 1;
+			break;
 		case 'f':
 			f = parse_format_opt(optarg);
 			if (f < 0) {
@@ -335,6 +356,7 @@ static int plooptool_start(int argc, char **argv)
 		close(lfd);
 		return SYSEXIT_DEVIOC;
 	}
+	ploop_devreg_invalidate();
 
 	if (ioctl(lfd, BLKRRPART, 0) < 0) {
 		perror("BLKRRPART");
@@ -437,6 +459,7 @@ static int plooptool_clear(int argc, char **argv)
 		close(lfd);
 		return SYSEXIT_DEVIOC;
 	}
+	ploop_devreg_invalidate();
 
 	close(lfd);
 	return 0;
@@ -586,11 +609,13 @@ static int plooptool_rm(int argc, char **argv)
 
 static void usage_snapshot(void)
 {
-	fprintf(stderr, "Usage: ploop snapshot [-u <uuid>] DiskDescriptor.xml\n"
+	fprintf(stderr, "Usage: ploop snapshot [-u <uuid>] [-P COUNT] DiskDescriptor.xml\n"
 			"       ploop snapshot [-F] -d DEVICE DELTA\n"
 			"       DEVICE := ploop device, e.g. /dev/ploop0\n"
 			"       DELTA := path to new image file\n"
 			"       -F     - synchronize file system before taking snapshot\n"
+			"       -P     - refill the pool of empty deltas up to COUNT\n"
+			"                once the snapshot is taken\n"
 		);
 }
 
@@ -598,10 +623,12 @@ static int plooptool_snapshot(int argc, char **argv)
 {
 	int i, ret;
 	char *device = NULL;
+	char *endptr;
+	unsigned long n;
 	int syncfs = 0;
 	struct ploop_snapshot_param param = {};
 
-	while ((i = getopt(argc, argv, "Fd:u:")) != EOF) {
+	while ((i = getopt(argc, argv, "Fd:u:P:")) != EOF) {
 		switch (i) {
 		case 'd':
 			device = optarg;
@@ -612,6 +639,15 @@ static int plooptool_snapshot(int argc, char **argv)
 		case 'u':
 			param.guid = optarg;
 			break;
+		case 'P':
+			n = strtoul(optarg, &endptr, 0);
+			if (endptr == optarg || *endptr != '\0' ||
+					*optarg == '-' || n > INT_MAX) {
+				usage_snapshot();
+				return SYSEXIT_PARAM;
+			}
+			param.pool = n;
+			break;
 		default:
 			usage_snapshot();
 			return SYSEXIT_PARAM;
@@ -646,6 +682,136 @@ static int plooptool_snapshot(int argc, char **argv)
 	return ret;
 }
 
+static void usage_snapshot_pool(void)
+{
+	fprintf(stderr, "Usage: ploop snapshot-pool -n COUNT DiskDescriptor.xml\n"
+			"       -n COUNT      number of empty deltas to keep ready,\n"
+			"                     0 to remove the pool\n");
+}
+
+static int plooptool_snapshot_pool(int argc, char **argv)
+{
+	int i, ret;
+	int count = -1;
+	char *endptr;
+	unsigned long n;
+	struct ploop_disk_images_data *di;
+
+	while ((i = getopt(argc, argv, "n:")) != EOF) {
+		switch (i) {
+		case 'n':
+			n = strtoul(optarg, &endptr, 0);
+			if (endptr == optarg || *endptr != '\0' ||
+					*optarg == '-' || n > INT_MAX) {
+				usage_snapshot_pool();
+				return SYSEXIT_PARAM;
+			}
+			count = n;
+			break;
+		default:
+			usage_snapshot_pool();
+			return SYSEXIT_PARAM;
+		}
+	}
+
+	argc -= optind;
+	argv += optind;
+
+	if (argc != 1 || count < 0 || !is_xml_fname(argv[0])) {
+		usage_snapshot_pool();
+		return SYSEXIT_PARAM;
+	}
+
+	ret = read_dd(&di, argv[0]);
+	if (ret)
+		return ret;
+
+	ret = ploop_refill_delta_pool(di, count);
+
+	ploop_free_diskdescriptor(di);
+
+	return ret;
+}
+
+static void usage_snapshot_diff(void)
+{
+	fprintf(stderr, "Usage: ploop snapshot-diff [-s] -u <uuid> [-t <uuid>] DiskDescriptor.xml\n"
+			"       -u <uuid>     snapshot to compare from\n"
+			"       -t <uuid>     snapshot to compare to (top delta if not specified)\n"
+			"       -s            print the totals only\n"
+			"Prints the changed extents as OFFSET LENGTH, in bytes\n");
+}
+
+static int plooptool_snapshot_diff(int argc, char **argv)
+{
+	int i, ret;
+	int summary = 0;
+	const char *from = NULL, *to = NULL;
+	struct ploop_disk_images_data *di;
+	struct ploop_snapshot_diff *diff;
+	__u64 k, start, cluster;
+
+	while ((i = getopt(argc, argv, "u:t:s")) != EOF) {
+		switch (i) {
+		case 'u':
+			from = optarg;
+			break;
+		case 't':
+			to = optarg;
+			break;
+		case 's':
+			summary = 1;
+			break;
+		default:
+			usage_snapshot_diff();
+			return SYSEXIT_PARAM;
+		}
+	}
+
+	argc -= optind;
+	argv += optind;
+
+	if (argc != 1 || from == NULL || !is_xml_fname(argv[0])) {
+		usage_snapshot_diff();
+		return SYSEXIT_PARAM;
+	}
+
+	ret = read_dd(&di, argv[0]);
+	if (ret)
+		return ret;
+
+	ret = ploop_snapshot_diff(di, from, to, &diff);
+	ploop_free_diskdescriptor(di);
+	if (ret)
+		return ret;
+
+	cluster = S2B(diff->blocksize);
+	if (summary) {
+		printf("%llu of %llu clusters changed (%llu bytes)\n",
+				(unsigned long long)diff->changed,
+				(unsigned long long)diff->nclusters,
+				(unsigned long long)(diff->changed * cluster));
+		goto out;
+	}
+
+	/* merge the runs of changed clusters into extents */
+	for (k = 0; k < diff->nclusters; ) {
+		if (!(diff->bitmap[k / 64] & (1ULL << (k % 64)))) {
+			k++;
+			continue;
+		}
+		for (start = k++; k < diff->nclusters &&
+				(diff->bitmap[k / 64] & (1ULL << (k % 64))); k++)
+			;
+		printf("%llu %llu\n", (unsigned long long)(start * cluster),
+				(unsigned long long)((k - start) * cluster));
+	}
+out:
+	ploop_free_snapshot_diff(diff);
+
+	return 0;
+}
+
 static void usage_snapshot_switch(void)
 {
 	fprintf(stderr, "Usage: ploop snapshot-switch -u <uuid> DiskDescriptor.xml\n"
@@ -737,8 +903,9 @@ static int plooptool_snapshot_delete(int argc, char **argv)
 
 static void usage_snapshot_merge(void)
 {
-	fprintf(stderr, "Usage: ploop snapshot-merge [-u <uuid> | -A] DiskDescriptor.xml\n"
-			"       -u <uuid>     snapshot uuid (top delta if not specified)\n");
+	fprintf(stderr, "Usage: ploop snapshot-merge [-u <uuid> | -A] [-c] DiskDescriptor.xml\n"
+			"       -u <uuid>     snapshot uuid (top delta if not specified)\n"
+			"       -c            merge parent into child if it moves less data\n");
 }
 
 static int plooptool_snapshot_merge(int argc, char ** argv)
@@ -746,7 +913,7 @@ static int plooptool_snapshot_merge(int argc, char ** argv)
 	int i, ret;
 	struct ploop_merge_param param = {};
 
-	while ((i = getopt(argc, argv, "u:A")) != EOF) {
+	while ((i = getopt(argc, argv, "u:Ac")) != EOF) {
 		switch (i) {
 		case 'u':
 			param.guid = optarg;
@@ -754,6 +921,9 @@ static int plooptool_snapshot_merge(int argc, char ** argv)
 		case 'A':
 			param.merge_all = 1;
 			break;
+		case 'c':
+			param.choose_direction = 1;
+			break;
 		default:
 			usage_snapshot_merge();
 			return SYSEXIT_PARAM;
@@ -787,6 +957,166 @@ static int plooptool_snapshot_merge(int argc, char ** argv)
 }
 
 
+static void usage_scrub(void)
+{
+	fprintf(stderr, "Usage: ploop scrub [-j THREADS] [-b RATE] [-l LIMIT] DiskDescriptor.xml\n"
+			"       THREADS := number of reader threads\n"
+			"       RATE := read rate limit per second, NUMBER[KMGT]\n"
+			"       LIMIT := amount of data to read in this run, NUMBER[KMGT]\n"
+		);
+}
+
+static int plooptool_scrub(int argc, char **argv)
+{
+	int i, ret;
+	char *endptr;
+	off_t size;
+	struct ploop_scrub_param param = {};
+
+	while ((i = getopt(argc, argv, "j:b:l:")) != EOF) {
+		switch (i) {
+		case 'j':
+			param.threads = strtoul(optarg, &endptr, 0);
+			if (*endptr != '\0') {
+				usage_scrub();
+				return SYSEXIT_PARAM;
+			}
+			break;
+		case 'b':
+			if (parse_size(optarg, &size, "-b"))
+				return SYSEXIT_PARAM;
+			param.rate = S2B(size);
+			break;
+		case 'l':
+			if (parse_size(optarg, &size, "-l"))
+				return SYSEXIT_PARAM;
+			param.max_bytes = S2B(size);
+			break;
+		default:
+			usage_scrub();
+			return SYSEXIT_PARAM;
+		}
+	}
+
+	argc -= optind;
+	argv += optind;
+
+	if (argc == 1 && is_xml_fname(argv[0])) {
+		struct ploop_disk_images_data *di;
+		ret = read_dd(&di, argv[0]);
+		if (ret)
+			return ret;
+
+		ret = ploop_scrub_image(di, &param);
+
+		ploop_free_diskdescriptor(di);
+	} else {
+		usage_scrub();
+		return SYSEXIT_PARAM;
+	}
+
+	return ret;
+}
+
+static void usage_batch(void)
+{
+	fprintf(stderr, "Usage: ploop mount-batch [-rF] [-j THREADS] DiskDescriptor.xml[:DIR] ...\n"
+			"       ploop umount-batch [-j THREADS] DiskDescriptor.xml ...\n"
+			"       THREADS := number of images processed in parallel\n"
+			"       DIR := directory to mount in-image filesystem to\n"
+			"       -r     - mount images read-only\n"
+			"       -F     - run fsck on inner filesystem before mounting it\n"
+		);
+}
+
+static int plooptool_batch(int argc, char **argv, int umount)
+{
+	int i, n, ret;
+	char *endptr, *p;
+	struct ploop_batch_param param = {};
+	struct ploop_batch_image *images;
+	struct ploop_mount_param *mountopts;
+	int ro = 0, fsck = 0;
+
+	while ((i = getopt(argc, argv, "rFj:")) != EOF) {
+		switch (i) {
+		case 'r':
+			ro = 1;
+			break;
+		case 'F':
+			fsck = 1;
+			break;
+		case 'j':
+			param.threads = strtoul(optarg, &endptr, 0);
+			if (*endptr != '\0') {
+				usage_batch();
+				return SYSEXIT_PARAM;
+			}
+			break;
+		default:
+			usage_batch();
+			return SYSEXIT_PARAM;
+		}
+	}
+
+	argc -= optind;
+	argv += optind;
+
+	if (argc < 1) {
+		usage_batch();
+		return SYSEXIT_PARAM;
+	}
+
+	images = calloc(argc, sizeof(struct ploop_batch_image));
+	mountopts = calloc(argc, sizeof(struct ploop_mount_param));
+	if (images == NULL || mountopts == NULL) {
+		fprintf(stderr, "Memory allocation failed\n");
+		ret = SYSEXIT_MALLOC;
+		goto err;
+	}
+
+	for (n = 0; n < argc; n++) {
+		p = umount ? NULL : strrchr(argv[n], ':');
+		if (p != NULL) {
+			*p++ = '\0';
+			mountopts[n].target = strdup(p);
+		}
+		if (!is_xml_fname(argv[n])) {
+			usage_batch();
+			ret = SYSEXIT_PARAM;
+			goto err;
+		}
+		ret = read_dd(&images[n].di, argv[n]);
+		if (ret)
+			goto err;
+
+		mountopts[n].ro = ro;
+		mountopts[n].fsck = fsck;
+		images[n].param = &mountopts[n];
+	}
+
+	ret = umount ? ploop_umount_images(images, argc, &param) :
+		ploop_mount_images(images, argc, &param);
+
+	for (i = 0; i < argc; i++)
+		if (images[i].result)
+			fprintf(stderr, "%s: failed (%d)\n", argv[i],
+					images[i].result);
+
+err:
+	if (images != NULL)
+		for (i = 0; i < argc; i++)
+			if (images[i].di != NULL)
+				ploop_free_diskdescriptor(images[i].di);
+	if (mountopts != NULL)
+		for (i = 0; i < argc; i++)
+			free(mountopts[i].target);
+	free(mountopts);
+	free(images);
+
+	return ret;
+}
+
 static void usage_getdevice(void)
 {
 	fprintf(stderr, "Usage: ploop getdev\n"
@@ -813,14 +1143,17 @@ static int plooptool_getdevice(int argc, char **argv)
 
 static void usage_resize(void)
 {
-	fprintf(stderr, "Usage: ploop resize -s NEW_SIZE DiskDescriptor.xml\n"
-			"       NEW_SIZE := NUMBER[KMGT]\n");
+	fprintf(stderr, "Usage: ploop resize -s NEW_SIZE [-S STEP] [-r RATE] DiskDescriptor.xml\n"
+			"       NEW_SIZE := NUMBER[KMGT]\n"
+			"       -S STEP  inflate the balloon by STEP at a time\n"
+			"       -r RATE  inflate the balloon by at most RATE per second\n");
 }
 
 static int plooptool_resize(int argc, char **argv)
 {
 	int i, ret;
 	off_t new_size = 0; /* in sectors */
+	off_t val;
 	int max_balloon_size = 0; /* make balloon file of max possible size */
 	struct ploop_resize_param param = {
 		.size		= 0,
@@ -828,7 +1161,7 @@ static int plooptool_resize(int argc, char **argv)
 	};
 	struct ploop_disk_images_data *di;
 
-	while ((i = getopt(argc, argv, "s:b")) != EOF) {
+	while ((i = getopt(argc, argv, "s:bS:r:")) != EOF) {
 		switch (i) {
 		case 's':
 			if (parse_size(optarg, &new_size, "-s")) {
@@ -837,6 +1170,20 @@ static int plooptool_resize(int argc, char **argv)
 			}
 			param.size = new_size;
 			break;
+		case 'S':
+			if (parse_size(optarg, &val, "-S")) {
+				usage_resize();
+				return SYSEXIT_PARAM;
+			}
+			param.balloon_step = S2B(val);
+			break;
+		case 'r':
+			if (parse_size(optarg, &val, "-r")) {
+				usage_resize();
+				return SYSEXIT_PARAM;
+			}
+			param.balloon_rate = S2B(val);
+			break;
 		case 'b':
 			max_balloon_size = 1;
 			break;
@@ -1097,14 +1444,24 @@ int main(int argc, char **argv)
 		return plooptool_rm(argc, argv);
 	if (strcmp(cmd, "snapshot") == 0)
 		return plooptool_snapshot(argc, argv);
+	if (strcmp(cmd, "snapshot-pool") == 0)
+		return plooptool_snapshot_pool(argc, argv);
 	if (strcmp(cmd, "snapshot-switch") == 0)
 		return plooptool_snapshot_switch(argc, argv);
 	if (strcmp(cmd, "snapshot-delete") == 0)
 		return plooptool_snapshot_delete(argc, argv);
 	if (strcmp(cmd, "snapshot-merge") == 0)
 		return plooptool_snapshot_merge(argc, argv);
+	if (strcmp(cmd, "snapshot-diff") == 0)
+		return plooptool_snapshot_diff(argc, argv);
 	if (strcmp(cmd, "snapshot-list") == 0)
 		return plooptool_snapshot_list(argc, argv);
+	if (strcmp(cmd, "scrub") == 0)
+		return plooptool_scrub(argc, argv);
+	if (strcmp(cmd, "mount-batch") == 0)
+		return plooptool_batch(argc, argv, 0);
+	if (strcmp(cmd, "umount-batch") == 0)
+		return plooptool_batch(argc, argv, 1);
 	if (strcmp(cmd, "getdev") == 0)
 		return plooptool_getdevice(argc, argv);
 	if (strcmp(cmd, "resize") == 0)